@@ -0,0 +1,198 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+/* medidor del rendimiento de las copias con cat en msh: mshcopybench [-s MiB] [-r repeticiones] msh directorio
+   crea en el directorio un fichero del tamano pedido y lo copia con "cat origen > destino", que msh
+   hace dentro del kernel, y con "/bin/cat origen > destino", que pasa por fork() y exec() del cat del
+   sistema. escribe el mejor tiempo de cada forma y los MB/s */
+
+#define DEFAULT_MIB 2048
+#define DEFAULT_RUNS 3
+#define FILL_BUFFER (1 << 20)
+
+/* funcion que devuelve el instante actual en segundos */
+double now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* funcion que crea el fichero de origen con mib MiB de datos que no son ceros, para que el
+   sistema de ficheros no lo guarde como disperso */
+int create_source(const char *file, long mib)
+{
+    char *buf = (char *) malloc(FILL_BUFFER);
+    unsigned int seed = 1;
+    int fd;
+    long i;
+    int j;
+
+    fd = open(file, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd == -1 || buf == NULL)
+    {
+        fprintf(stderr, "No ha sido posible crear el archivo %s. Error: %s\n", file, strerror(errno));
+        free(buf);
+        return -1;
+    }
+
+    for (j = 0; j < FILL_BUFFER; j++)
+    {
+        seed = seed * 1103515245 + 12345;
+        buf[j] = (char) (seed >> 16);
+    }
+    for (i = 0; i < mib; i++)
+    {
+        // cambiamos el primer byte de cada MiB para que no haya bloques repetidos
+        buf[0] = (char) i;
+        if (write(fd, buf, FILL_BUFFER) != FILL_BUFFER)
+        {
+            fprintf(stderr, "No ha sido posible escribir el archivo %s. Error: %s\n", file, strerror(errno));
+            close(fd);
+            free(buf);
+            return -1;
+        }
+    }
+
+    // que la escritura a disco del origen no caiga en medio de las copias
+    fsync(fd);
+    close(fd);
+    free(buf);
+
+    return 0;
+}
+
+/* funcion que ejecuta msh -c comando y devuelve los segundos que tarda, o -1 si falla */
+double run_shell(const char *msh, const char *command)
+{
+    double start = now();
+    pid_t pid;
+    int status;
+
+    pid = fork();
+    if (pid < 0)
+    {
+        fprintf(stderr, "Error en el fork() \n %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0)
+    {
+        execl(msh, msh, "-c", command, (char *) NULL);
+        fprintf(stderr, "No ha sido posible ejecutar %s. Error: %s\n", msh, strerror(errno));
+        exit(1);
+    }
+
+    waitpid(pid, &status, 0);
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "El comando %s ha fallado.\n", command);
+        return -1;
+    }
+
+    return now() - start;
+}
+
+/* funcion que copia una vez con el cat dado y devuelve los segundos que tarda, o -1 si falla */
+double copy_once(const char *msh, const char *cat, const char *source, const char *dest, long mib)
+{
+    char command[4096];
+    struct stat st;
+    double t;
+
+    // con -c msh reemplazaria su ultimo comando por el cat sin fork(); el true final lo evita
+    snprintf(command, sizeof(command), "%s %s > %s; true", cat, source, dest);
+    unlink(dest);
+    t = run_shell(msh, command);
+
+    // una copia incompleta no cuenta como rapida
+    if (t >= 0 && (stat(dest, &st) != 0 || st.st_size != mib * FILL_BUFFER))
+    {
+        fprintf(stderr, "La copia %s no tiene el tamano del origen.\n", dest);
+        t = -1;
+    }
+    unlink(dest);
+
+    return t;
+}
+
+/* funcion principal */
+int main(int argc, char *argv[])
+{
+    // variables
+    char source[4096];
+    char dest[4096];
+    double fast = -1;
+    double slow = -1;
+    double t;
+    long mib = DEFAULT_MIB;
+    int runs = DEFAULT_RUNS;
+    int opt;
+    int i;
+
+    while ((opt = getopt(argc, argv, "s:r:")) != -1)
+    {
+        if (opt == 's')
+        {
+            mib = atol(optarg);
+        }
+        else if (opt == 'r')
+        {
+            runs = atoi(optarg);
+        }
+        else
+        {
+            mib = 0;
+            break;
+        }
+    }
+    if (argc - optind != 2 || mib <= 0 || runs <= 0)
+    {
+        fprintf(stderr, "Uso: %s [-s MiB] [-r repeticiones] msh directorio\n", argv[0]);
+        return 1;
+    }
+
+    snprintf(source, sizeof(source), "%s/mshcopybench.src", argv[optind + 1]);
+    snprintf(dest, sizeof(dest), "%s/mshcopybench.dst", argv[optind + 1]);
+    if (create_source(source, mib) != 0)
+    {
+        unlink(source);
+        return 1;
+    }
+
+    // las dos formas leen el origen de la cache de paginas, que ya esta caliente tras crearlo, y se
+    // alternan para que ninguna se lleve siempre el mismo estado del sistema; cuenta el mejor tiempo
+    for (i = 0; i < runs; i++)
+    {
+        if ((t = copy_once(argv[optind], "cat", source, dest, mib)) < 0)
+        {
+            break;
+        }
+        fast = fast < 0 || t < fast ? t : fast;
+        if ((t = copy_once(argv[optind], "/bin/cat", source, dest, mib)) < 0)
+        {
+            break;
+        }
+        slow = slow < 0 || t < slow ? t : slow;
+    }
+    unlink(source);
+    if (t < 0)
+    {
+        return 1;
+    }
+
+    printf("%-28s %10s %10s\n", "copia", "segundos", "MB/s");
+    printf("%-28s %10.3f %10.1f\n", "cat (dentro del kernel)", fast, mib * 1.048576 / fast);
+    printf("%-28s %10.3f %10.1f\n", "/bin/cat (fork y exec)", slow, mib * 1.048576 / slow);
+    printf("aceleracion: %.2fx\n", slow / fast);
+
+    return 0;
+}
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+#include "trace.h"
+
+/* decodificador de las trazas de msh: mshtrace [-c] fichero
+   por defecto escribe un array JSON con un objeto por registro, con -c el formato
+   de Chrome trace (chrome://tracing, Perfetto) */
+
+static const char *event_names[] = {
+    "", "line-read", "tokenize-begin", "tokenize-end", "fork",
+    "exec-fail", "redirect", "wait-complete", "signal"
+};
+
+/* funcion que escribe una cadena JSON escapando comillas, barras y caracteres de control */
+void print_json_string(const char *s)
+{
+    putchar('"');
+    for (; *s != '\0'; s++)
+    {
+        if (*s == '"' || *s == '\\')
+        {
+            printf("\\%c", *s);
+        }
+        else if ((unsigned char) *s < 0x20)
+        {
+            printf("\\u%04x", (unsigned char) *s);
+        }
+        else
+        {
+            putchar(*s);
+        }
+    }
+    putchar('"');
+}
+
+/* funcion que escribe un registro como objeto JSON */
+void print_record(const ttrace_record *r, uint64_t start)
+{
+    printf("{\"time_ns\": %llu, \"event\": \"%s\", \"pid\": %d, \"stage\": %d, \"arg\": %lld, \"name\": ",
+           (unsigned long long) (r->time - start), event_names[r->event], r->pid, r->stage, (long long) r->arg);
+    print_json_string(r->name);
+    putchar('}');
+}
+
+/* funcion que escribe un registro como evento de Chrome trace: cada hijo es un proceso con un
+   tramo desde su fork hasta que el shell lo espera, el resto son eventos instantaneos */
+void print_chrome_event(const ttrace_record *r, uint64_t start)
+{
+    const char *phase = "i";
+
+    if (r->event == TRACE_FORK || r->event == TRACE_TOKENIZE_BEGIN)
+    {
+        phase = "B";
+    }
+    else if (r->event == TRACE_WAIT_DONE || r->event == TRACE_TOKENIZE_END)
+    {
+        phase = "E";
+    }
+
+    // los tramos se cierran por pid y tid, el nombre del E es solo informativo
+    printf("{\"name\": ");
+    if (r->event == TRACE_FORK || r->event == TRACE_WAIT_DONE)
+    {
+        print_json_string(r->name);
+    }
+    else
+    {
+        print_json_string(phase[0] == 'i' ? event_names[r->event] : "tokenize");
+    }
+    printf(", \"cat\": \"%s\", \"ph\": \"%s\", \"ts\": %.3f, \"pid\": %d, \"tid\": %d",
+           event_names[r->event], phase, (r->time - start) / 1000.0, r->pid, r->stage < 0 ? 0 : r->stage);
+    if (phase[0] == 'i')
+    {
+        printf(", \"s\": \"t\"");
+    }
+    printf(", \"args\": {\"arg\": %lld, \"name\": ", (long long) r->arg);
+    print_json_string(r->name);
+    printf("}}");
+}
+
+/* funcion principal */
+int main(int argc, char *argv[])
+{
+    // variables
+    const ttrace_header *header;
+    const ttrace_record *records;
+    const ttrace_record *r;
+    struct stat st;
+    uint64_t first;
+    uint64_t i;
+    uint64_t start;
+    int chrome = 0;
+    int printed = 0;
+    int fd;
+
+    if (argc == 3 && strcmp(argv[1], "-c") == 0)
+    {
+        chrome = 1;
+    }
+    else if (argc != 2)
+    {
+        fprintf(stderr, "Uso: %s [-c] fichero_de_traza\n", argv[0]);
+        return 1;
+    }
+
+    fd = open(argv[argc - 1], O_RDONLY);
+    if (fd == -1 || fstat(fd, &st) != 0)
+    {
+        fprintf(stderr, "No ha sido posible abrir el archivo %s. Error: %s\n", argv[argc - 1], strerror(errno));
+        return 1;
+    }
+
+    header = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (header == MAP_FAILED || (size_t) st.st_size < sizeof(ttrace_header)
+            || memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0
+            || header->version != TRACE_VERSION || header->record_size != sizeof(ttrace_record)
+            || (size_t) st.st_size < sizeof(ttrace_header) + header->capacity * sizeof(ttrace_record))
+    {
+        fprintf(stderr, "El archivo %s no es una traza de msh valida.\n", argv[argc - 1]);
+        return 1;
+    }
+    records = (const ttrace_record *) (header + 1);
+
+    // si el buffer ha dado la vuelta, los registros mas antiguos se han sobrescrito
+    first = header->head > header->capacity ? header->head - header->capacity : 0;
+    start = header->head > 0 ? records[first % header->capacity].time : 0;
+
+    printf(chrome ? "{\"traceEvents\": [\n" : "[\n");
+    for (i = first; i < header->head; i++)
+    {
+        r = &records[i % header->capacity];
+
+        // un registro a medio escribir cuando murio el shell no se muestra
+        if (r->event < TRACE_LINE_READ || r->event > TRACE_SIGNAL || r->time < start)
+        {
+            continue;
+        }
+
+        printf(printed++ ? ",\n  " : "  ");
+        if (chrome)
+        {
+            print_chrome_event(r, start);
+        }
+        else
+        {
+            print_record(r, start);
+        }
+    }
+    printf(chrome ? "\n], \"displayTimeUnit\": \"ns\"}\n" : "\n]\n");
+
+    return 0;
+}
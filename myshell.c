@@ -1,361 +1,5578 @@
+#define _GNU_SOURCE
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <ctype.h>
+#include <stdint.h>
 #include <signal.h>
 #include <fcntl.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <termios.h>
+#include <dirent.h>
+#include <poll.h>
+#include <sys/timerfd.h>
+#include <sys/syscall.h>
+#include <sys/sendfile.h>
+#include <elf.h>
+#include <pthread.h>
+#include <linux/futex.h>
 
 #include "parser.h"
+#include "trace.h"
 
 #define SIZE 1024
+#define READER_SIZE 65536
+#define TIMEOUT_STATUS 124            // estado de una tuberia que supera su tiempo limite
+#define TIMEOUT_GRACE 2000000000LL    // ns entre SIGTERM y SIGKILL si no se indica -k
+#define TIMEOUT_POLL 10               // ms entre comprobaciones del grupo durante la gracia
+#define CACHE_BUCKETS 1024            // cubetas de la cache de lineas, potencia de 2
+#define CACHE_ENTRIES 512             // maximo de lineas guardadas en la cache
+#define CACHE_BYTES (1 << 20)         // maximo de memoria de la cache de lineas
+#define ARG_HEADROOM 2048             // margen de ARG_MAX que deja xargs, como el de POSIX
+#define PREFETCH_HOT 8                // ejecutables mas lanzados que se mantienen en memoria
+#define PREFETCH_INTERVAL 30          // segundos antes de volver a precargar un ejecutable
+#define PREFETCH_LEAD 2               // segundos de antelacion para que una precarga cuente como acierto
+#define RING_SIZE 65536               // bytes del buffer circular entre dos etapas en hilos
+#define RING_SPINS 100                // vueltas esperando al otro hilo antes de dormir
+#define COPY_CHUNK 0x40000000         // bytes por llamada de copia dentro del kernel
+#define COPY_BUFFER 131072            // buffer de la copia por read/write si el kernel no puede
+
+/* subdirectorio multiarch de las bibliotecas del sistema, para buscar las dependencias ELF */
+#if defined(__x86_64__)
+#define MULTIARCH "x86_64-linux-gnu"
+#elif defined(__aarch64__)
+#define MULTIARCH "aarch64-linux-gnu"
+#else
+#define MULTIARCH ""
+#endif
+
+/* estado del analisis de una linea o bloque de lineas */
+#define PARSE_OK 0
+#define PARSE_INCOMPLETE 1
+#define PARSE_ERROR 2
+
+/* marcas que sustituyen a un $( ), $(( )) o `` en el texto que se pasa a tokenize():
+   $\001indice\001 fuera de comillas dobles y $\002indice\002 dentro, donde no se parte en palabras */
+#define SUBST_MARK '\001'
+#define SUBST_QUOTED '\002'
 
 static int run = 1;
+static int last_status = 0;  // valor de $?
+static int in_condition = 0; // > 0 mientras se evalua la condicion de un if, while, && o ||
+static int expand_failed = 0; // alguna expansion de la ultima palabra ha fallado
+static int subst_depth = 0;   // > 0 mientras se ejecuta una sustitucion de comando
+static int subst_ran = 0;     // se ha ejecutado una sustitucion al expandir el ultimo comando
+static int subst_exit = 0;    // se ha ejecutado exit en la sustitucion actual, que deja de ejecutarse
+static int trace_stage = -1;  // indice del comando de la tuberia en los hijos, para la traza
 
-/* funcion manejadora del signal */
-void exit_handler()
+/* buffer de caracteres que crece segun se necesita */
+typedef struct
 {
-    run = 0;
-}
+    char *data;
+    size_t len;
+    size_t cap;
+} tbuffer;
 
-/* funcion que comprueba si el argumento line contiene el comando seleccionado */
-int handle_command(tline *line, int n_commands, char command[])
+/* vector de cadenas que crece segun se necesita */
+typedef struct
 {
-    if (line->ncommands == n_commands && strcmp(line->commands[0].argv[0], command) == 0)
-    {
-        return 0;
-    }
+    char **items;
+    int len;
+    int cap;
+} tvec;
 
-    return 1;
-}
+/* buffer circular de un productor y un consumidor entre dos etapas de una tuberia que se
+   ejecutan como hilos del shell. head y tail solo crecen y cada uno lo escribe un solo hilo,
+   asi que no hace falta cerrojo; solo se entra al kernel para dormir cuando esta lleno o vacio */
+typedef struct tring
+{
+    char data[RING_SIZE];
+    uint64_t head;          // bytes escritos en total, lo cambia el productor
+    uint64_t tail;          // bytes leidos en total, lo cambia el consumidor
+    uint32_t wake;          // cambia con cada avance, para dormir con futex
+    int sleeping;           // algun hilo duerme esperando un cambio de wake
+    int closed;             // el productor ha terminado
+    int abandoned;          // el consumidor ha terminado y lo que se escriba se descarta
+} tring;
 
-/* funcion ejecutar el comando cd */
-void execute_cd_command(tline *line)
+/* lector con buffer sobre un descriptor, usado para la entrada del shell y el builtin read */
+typedef struct treader
 {
-    // variables
-    char dir[SIZE];
+    int fd;
+    tring *ring;            // si no es NULL se lee de este buffer circular en vez de fd
+    char *buf;
+    size_t pos;
+    size_t len;
+    size_t cap;
+    struct treader *prev;
+} treader;
 
-    // si solo tenemos un comando
-    if (line->ncommands == 1)
+/* variable del shell */
+typedef struct tvar
+{
+    char *name;
+    char *value;
+    struct tvar *next;
+} tvar;
+
+/* ejecutable lanzado por el shell, con sus bibliotecas para precargarlas */
+typedef struct tprefetch
+{
+    char *path;
+    unsigned long launches;
+    unsigned long hits;     // lanzamientos con el ejecutable ya precargado
+    int pending;            // precargado y aun no lanzado
+    int typed;              // la ultima precarga la pidio el nombre que se estaba escribiendo
+    int resolved;           // ya se han buscado sus dependencias
+    time_t warmed;          // ultima precarga
+    tvec deps;              // interprete y bibliotecas DT_NEEDED
+    struct tprefetch *next;
+} tprefetch;
+
+/* tiempo limite de una tuberia en primer plano */
+typedef struct
+{
+    int64_t limit;      // nanosegundos hasta enviar SIGTERM
+    int64_t grace;      // nanosegundos desde SIGTERM hasta SIGKILL
+    const char *text;   // limite tal y como se escribio, para los mensajes
+} ttimeout;
+
+/* builtin que se ejecuta dentro del propio shell */
+typedef struct
+{
+    const char *name;
+    int (*fn)(int argc, char **argv);
+    int threads;            // no toca el estado del shell y puede ser un hilo de una tuberia
+} tbuiltin;
+
+/* etapa de una tuberia que se ejecuta como hilo del shell en lugar de hacer fork() */
+typedef struct
+{
+    const tbuiltin *builtin;  // NULL si la etapa es un proceso
+    tcommand *command;
+    int index;
+    int in_fd;              // descriptor de entrada, -1 si viene de un buffer o es la del shell
+    int out_fd;             // descriptor de salida, -1 si va a un buffer
+    tring *in;
+    tring *out;
+    treader *reader;        // lector de la entrada del hilo
+    int status;
+    pthread_t thread;
+} tstage;
+
+/* tipos de nodo del arbol de control */
+typedef enum
+{
+    NODE_SIMPLE,
+    NODE_AND,
+    NODE_OR,
+    NODE_IF,
+    NODE_WHILE,
+    NODE_UNTIL,
+    NODE_FOR,
+    NODE_ARITH
+} tnode_type;
+
+/* linea tokenizada en la cache: el tline empaquetado no se modifica y lo comparten los nodos
+   que la usan; si se expulsa mientras algun nodo la usa, se libera al soltar el ultimo */
+typedef struct tcached
+{
+    uint64_t hash;
+    size_t len;
+    size_t size;          // bytes de la entrada, texto y tline incluidos
+    int refs;             // nodos que la estan usando
+    int evicted;          // ya no esta en la cache
+    tline *line;
+    struct tcached *next; // siguiente de la misma cubeta
+    struct tcached *newer;
+    struct tcached *older;
+    char text[];          // texto que se paso a tokenize()
+} tcached;
+
+/* nodo del arbol de control: se analiza una vez y se ejecuta tantas veces como haga falta */
+typedef struct tnode
+{
+    tnode_type type;
+    tline *line;          // comando simple ya tokenizado (copia propia o de la cache)
+    tcached *cached;      // entrada de la cache a la que pertenece line, si la hay
+    int expand;           // el comando simple contiene '$' y hay que expandirlo
+    struct tnode *cond;   // condicion de if/while/until, operando izquierdo de && y ||
+    struct tnode *body;   // then, cuerpo del bucle u operando derecho de && y ||
+    struct tnode *other;  // else o elif
+    struct tnode *next;   // siguiente comando de la lista
+    char *var;            // variable del for
+    tvec words;           // palabras del for
+    tvec subst;           // expansiones $(( )) sacadas del texto antes de tokenizarlo
+    char *expr;           // expresion del comando (( ))
+    char *redirect_input;
+    char *redirect_output;
+    char *redirect_error;
+} tnode;
+
+/* nodo del trie de ejecutables del PATH: primer hijo y siguiente hermano, ordenados por caracter */
+typedef struct ttrie
+{
+    char c;
+    int end;              // aqui termina el nombre de un ejecutable
+    struct ttrie *child;
+    struct ttrie *next;
+} ttrie;
+
+/* directorio del PATH con la fecha de modificacion que tenia al indexarlo */
+typedef struct
+{
+    char *dir;
+    struct timespec mtime;
+} tpath_dir;
+
+/* estado del analizador del arbol de control */
+typedef struct
+{
+    const char *s;
+    size_t pos;
+    int status;
+    int check;  // solo se comprueba si el texto esta completo, sin tokenizar los comandos
+} tparser;
+
+static __thread treader *input = NULL; // lector de la entrada estandar actual
+static __thread tstage *current_stage = NULL; // etapa que ejecuta este hilo, NULL en el principal
+static tvar *vars = NULL;
+static ttrace_header *trace = NULL; // traza en memoria compartida, NULL si no se ha pedido
+static ttrace_record *trace_records = NULL;
+static ttrie *commands_trie = NULL; // ejecutables del PATH para el completado
+static tpath_dir *path_dirs = NULL;
+static int npath_dirs = 0;
+static char *indexed_path = NULL;   // PATH con el que se construyo el trie
+static tcached *cache_buckets[CACHE_BUCKETS];
+static tcached *cache_newest = NULL; // lista LRU, de la mas reciente a la mas antigua
+static tcached *cache_oldest = NULL;
+static char *cache_path = NULL;     // PATH con el que se resolvieron las lineas guardadas
+static int cache_entries = 0;
+static size_t cache_bytes = 0;
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+static tprefetch *launched = NULL;  // ejecutables lanzados, para la precarga
+
+int execute_list(tnode *node);
+const tbuiltin *find_builtin(const char *name);
+tnode *parse_text(const char *s, int *status);
+void free_node(tnode *node);
+void extract_substs(const char *s, size_t n, tbuffer *text, tvec *subst);
+
+/* funcion que añade un registro a la traza; pid 0 es el propio proceso.
+   es segura en los hijos y en el manejador de señales */
+void trace_event(ttrace_event event, pid_t pid, int stage, int64_t arg, const char *name)
+{
+    ttrace_record *r;
+    struct timespec ts;
+    int i;
+
+    if (trace == NULL)
     {
-        // comprobamos si el comando es "cd" o "cd" con argumentos
-        if (line->commands[0].argc == 1)
-        {
-            strcpy(dir, getenv("HOME")); // apuntamos al directorio HOME solo si es 1 argumento
-            if (dir == NULL)
-            {
-                fprintf(stderr, "No existe la variable $HOME"); // no existe
-            }
-        }
-        else
-        {
-            strcpy(dir, line->commands[0].argv[1]); // apuntamos al directorio del parametro si solo son 2 argumentos
-        }
+        return;
+    }
 
-        // cambiamos de directorio y lo imprimimos
-        if (chdir(dir) != 0)
-        {
-            fprintf(stderr, "Error al cambiar de directorio: %s\n", strerror(errno));
-        }
+    if (pid == 0)
+    {
+        pid = getpid();
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r = &trace_records[__atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED) % trace->capacity];
 
-        // imprimimos el directorio actual
-        printf("El directorio actual es: %s\n", getcwd(dir, SIZE));
+    r->time = (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+    r->arg = arg;
+    r->pid = pid;
+    r->stage = stage;
+    r->event = event;
+    r->reserved = 0;
+    for (i = 0; i < TRACE_NAME - 1 && name != NULL && name[i] != '\0' && name[i] != '\n'; i++)
+    {
+        r->name[i] = name[i];
     }
+    r->name[i] = '\0';
 }
 
-/* funcion para manejar las redirecciones */ 
-int handle_redirect(char *file, char mode)
+/* funcion que abre el fichero de traza de MSH_TRACE y lo proyecta en memoria compartida,
+   asi los hijos escriben en el mismo buffer y lo escrito sobrevive aunque el shell muera.
+   despues se quita MSH_TRACE del entorno: un msh anidado lo heredaria y volveria a truncar el
+   fichero mientras este shell lo tiene proyectado */
+void trace_open()
 {
-    int d = -1;
-    mode_t userMode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+    char *path = getenv("MSH_TRACE");
+    char *records = getenv("MSH_TRACE_RECORDS");
+    uint64_t capacity = records != NULL ? strtoull(records, NULL, 10) : TRACE_RECORDS;
+    size_t size;
+    void *map;
+    int fd;
 
-    // char 'r' para indicar la lectura (read)
-    if (mode == 'r')
+    if (path == NULL || *path == '\0')
     {
-        d = open(file, O_RDONLY); // abrimos para lectura sólo
+        return;
+    }
+    if (capacity == 0)
+    {
+        capacity = TRACE_RECORDS;
     }
 
-    // char 'w' para indicar la escritura (write)
-    if (mode == 'w')
+    size = sizeof(ttrace_header) + capacity * sizeof(ttrace_record);
+    fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd == -1 || ftruncate(fd, size) != 0)
     {
-        d = open(file, O_WRONLY | O_CREAT | O_TRUNC, userMode); // abrimos para escritura sólo
+        fprintf(stderr, "No ha sido posible crear la traza %s: %s\n", path, strerror(errno));
+        if (fd != -1)
+        {
+            close(fd);
+        }
+        return;
     }
 
-    // si el descriptor no fue modificado o no se puedo abrir, entonces existe un error
-    if (d == -1)
+    map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
     {
-        fprintf(stderr, "No ha sido posible abrir el archivo %s \n. Error: %s\n", file, strerror(errno));
-        close(d);
-        exit(-1);
+        fprintf(stderr, "No ha sido posible proyectar la traza %s: %s\n", path, strerror(errno));
+        return;
     }
 
-    return d;
+    trace = (ttrace_header *) map;
+    memcpy(trace->magic, TRACE_MAGIC, sizeof(trace->magic));
+    trace->version = TRACE_VERSION;
+    trace->record_size = sizeof(ttrace_record);
+    trace->capacity = capacity;
+    trace->head = 0;
+    trace_records = (ttrace_record *) (trace + 1);
+
+    unsetenv("MSH_TRACE");
+    unsetenv("MSH_TRACE_RECORDS");
 }
 
-/* funcion para redirigir a entrada estandar */
-void redirect_to_stdin(tline *line)
+/* funcion manejadora del signal */
+void exit_handler(int sig)
 {
-    int d;
+    trace_event(TRACE_SIGNAL, 0, -1, sig, sig == SIGINT ? "SIGINT" : sig == SIGQUIT ? "SIGQUIT" : "");
+    run = 0;
+}
 
-    if (line->redirect_input != NULL)
+/* funcion que añade n caracteres al buffer manteniendolo terminado en '\0' */
+void buffer_append(tbuffer *b, const char *s, size_t n)
+{
+    if (b->len + n + 1 > b->cap)
     {
-        d = handle_redirect(line->redirect_input, 'r');
-        dup2(d, 0);
+        while (b->len + n + 1 > b->cap)
+        {
+            b->cap = b->cap == 0 ? SIZE : b->cap * 2;
+        }
+        b->data = realloc(b->data, b->cap);
     }
+
+    memcpy(b->data + b->len, s, n);
+    b->len += n;
+    b->data[b->len] = '\0';
 }
 
-/* funcion para redirigir a salida estandar */
-void redirect_to_stdout(tline *line)
+/* funcion que añade una cadena al vector */
+void vec_push(tvec *v, char *s)
 {
-    int d;
-
-    if (line->redirect_output != NULL)
+    if (v->len == v->cap)
     {
-        d = handle_redirect(line->redirect_output, 'w');
-        dup2(d, 1);
+        v->cap = v->cap == 0 ? 8 : v->cap * 2;
+        v->items = realloc(v->items, v->cap * sizeof(char *));
     }
+
+    v->items[v->len++] = s;
 }
 
-/* funcion para redirigir a la salida de error */
-void redirect_to_stderr(tline *line)
+/* funcion que libera las cadenas del vector y el propio vector */
+void vec_free(tvec *v)
 {
-    int d;
+    int i;
 
-    if (line->redirect_error != NULL)
+    for (i = 0; i < v->len; i++)
     {
-        d = handle_redirect(line->redirect_error, 'w');
-        dup2(d, 2);
+        free(v->items[i]);
     }
+    free(v->items);
+    v->items = NULL;
+    v->len = 0;
+    v->cap = 0;
 }
 
-/* funcion principal para ejecutar 1 o n comandos */
-void execute_command(tline *line)
+/* funcion que indica si el buffer tiene datos o esta cerrado (consumidor), o hueco o esta abandonado (productor) */
+int ring_ready(tring *r, int producer)
 {
-    // variables
-    pid_t pid;
-    int status;
-
-    // control del numero de comandos introducidos
-    if (line->ncommands == 1)
+    if (producer)
     {
-        // hacemos el fork()
-        pid = fork();
+        return r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) < RING_SIZE
+            || __atomic_load_n(&r->abandoned, __ATOMIC_ACQUIRE);
+    }
 
-        // error
-        if (pid < 0)
+    return __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) != r->tail || __atomic_load_n(&r->closed, __ATOMIC_ACQUIRE);
+}
+
+/* funcion que espera a que el buffer este listo para el productor o el consumidor. se anuncia en
+   sleeping antes de volver a comprobarlo, y futex no duerme si wake ha cambiado desde entonces */
+void ring_wait(tring *r, int producer)
+{
+    uint32_t seen;
+    int spins = 0;
+
+    while (1)
+    {
+        seen = __atomic_load_n(&r->wake, __ATOMIC_SEQ_CST);
+        if (ring_ready(r, producer))
         {
-            fprintf(stderr, "Error en el fork() \n %s\n", strerror(errno));
-            exit(-1);
+            return;
         }
-        
-        // proceso hijo
-        if (pid == 0)
+        if (spins++ < RING_SPINS)
         {
-            // redirecciones en el primer comando por que sólo hay un comando
-            redirect_to_stdin(line);
-            redirect_to_stdout(line);
-            redirect_to_stderr(line);
+            continue;
+        }
 
-            if (line->commands[0].filename != NULL)
-            {
-                // el hijo ejecuta el comando con sus opciones
-                execvp(line->commands[0].argv[0], line->commands[0].argv);
-                printf("Se ha producido un error en la ejecucion del comando.\n");
-                exit(1); // error si consigue llegar hasta aqui
-            }
-            else
-            {
-                fprintf(stderr, "El comando %s no se encuentra.", line->commands[0].argv[0]);
-                exit(1);
-            }
+        __atomic_store_n(&r->sleeping, 1, __ATOMIC_SEQ_CST);
+        if (ring_ready(r, producer))
+        {
+            return;
         }
+        syscall(SYS_futex, &r->wake, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
     }
-    else if (line->ncommands > 1)
+}
+
+/* funcion que avisa al otro hilo de que el buffer ha cambiado, despertandolo solo si duerme */
+void ring_notify(tring *r)
+{
+    __atomic_fetch_add(&r->wake, 1, __ATOMIC_SEQ_CST);
+    if (__atomic_exchange_n(&r->sleeping, 0, __ATOMIC_SEQ_CST))
     {
-        // variables
-        int i;
-        int size_array = line -> ncommands - 1;
-        int size_commands = line -> ncommands;
-        int **p = (int **) malloc (size_array * sizeof(int *));
+        syscall(SYS_futex, &r->wake, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+    }
+}
 
-        // una vez reservado el espacio del array de arrays de integer, 
-        // en cada posicion reservamos un array de 2 posiciones
-        for (i = 0; i < size_array; i++)
+/* funcion que escribe n bytes en el buffer; devuelve -1 si el consumidor ya no lee */
+int ring_write(tring *r, const char *s, size_t n)
+{
+    size_t chunk;
+    size_t free_space;
+    size_t offset;
+
+    while (n > 0)
+    {
+        ring_wait(r, 1);
+        if (__atomic_load_n(&r->abandoned, __ATOMIC_ACQUIRE))
         {
-            p[i] = (int *)malloc(2 * sizeof(int));
+            return -1;
         }
 
-        // por cada comando, duplicamos el proceso y creamos un pipe
-        for (i = 0; i < size_commands; i++)
-        {
-            // creamos un pipe excepto en el último comando
-            if (i != size_array)
-            {
-                pipe(p[i]);
-            }
+        // copiamos lo que cabe hasta el final del array, el resto en la siguiente vuelta
+        free_space = RING_SIZE - (r->head - __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE));
+        offset = r->head % RING_SIZE;
+        chunk = n < free_space ? n : free_space;
+        chunk = chunk < RING_SIZE - offset ? chunk : RING_SIZE - offset;
 
-            // hacemos el fork()
-            pid = fork();
+        memcpy(r->data + offset, s, chunk);
+        __atomic_store_n(&r->head, r->head + chunk, __ATOMIC_RELEASE);
+        ring_notify(r);
+        s += chunk;
+        n -= chunk;
+    }
 
-            // error
-            if (pid < 0)
-            {
-                fprintf(stderr, "Error en el fork() \n %s\n", strerror(errno));
-                exit(-1);
-            }
-            
-            // proceso hijo
-            if (pid == 0)
-            {
-                // redirección primer comando
-                if (i == 0)
-                {
-                    // cerramos la parte de lectura no utilizada
-                    close(p[i][0]);
+    return 0;
+}
 
-                    // el primer hijo controla la redirección del input
-                    redirect_to_stdin(line);
-                    
-                    // y escribimos
-                    dup2(p[i][1], 1);
-                }
-                else if (i == size_array)
-                {
-                    // cerramos la parte de escritura no utilizada
-                    close(p[i-1][1]);
+/* funcion que lee como mucho n bytes del buffer; devuelve 0 cuando el productor ha terminado */
+ssize_t ring_read(tring *r, char *buf, size_t n)
+{
+    size_t avail;
+    size_t offset;
+    size_t chunk;
 
-                    // el ultimo hijo controla la redirección del output y error
-                    redirect_to_stdout(line);
-                    redirect_to_stderr(line);
+    ring_wait(r, 0);
+    avail = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE) - r->tail;
+    if (avail == 0)
+    {
+        return 0;
+    }
 
-                    // y leeemos
-                    dup2(p[i-1][0], 0);
-                }
-                else
-                {
-                    // cerramos de manera correcta
-                    close(p[i-1][1]);
-                    close(p[i][0]);
+    offset = r->tail % RING_SIZE;
+    chunk = n < avail ? n : avail;
+    chunk = chunk < RING_SIZE - offset ? chunk : RING_SIZE - offset;
 
-                    // y sino es ni el primero ni el ultimo,
-                    // conectamos las tuberias de la manera correcta
-                    dup2(p[i-1][0], 0);
-                    dup2(p[i][1], 1);
-                }
+    memcpy(buf, r->data + offset, chunk);
+    __atomic_store_n(&r->tail, r->tail + chunk, __ATOMIC_RELEASE);
+    ring_notify(r);
 
-                // cerrar los pipes previos
-                for (int j = 0; j < i; j++)
-                {
-                    close(p[j][0]);
-                    close(p[j][1]);
-                }
+    return chunk;
+}
 
-                // una vez hecho las redirecciones necesarias, ejecutamos
-                if (line->commands[i].filename != NULL)
-                {
-                    // ejecutamos el comando con sus opciones
-                    pid = execvp(line->commands[i].argv[0], line->commands[i].argv);
-                    printf("Se ha producido un error en la ejecucion del comando %s.\n", line->commands[i].argv[0]);
-                    
-                    exit(1); // error si consigue llegar aqui
-                }
-                else
-                {
-                    printf("El comando introducido %s no se ha encontrado.\n", line->commands[i].argv[0]);
-                    
-                    exit(1);
-                }
-            }
-        }
+/* funcion que marca el final de lo escrito por el productor */
+void ring_close(tring *r)
+{
+    __atomic_store_n(&r->closed, 1, __ATOMIC_RELEASE);
+    ring_notify(r);
+}
 
-        // cerramos pipes y liberamos memoria
-        for (i = 0; i < size_array; i++)
-        {
-            // si no se cierran los descriptores de los pipes anteriores
-            // el comando se cree que tiene todavía cosas por leer
-            close(p[i][0]);
-            close(p[i][1]);
+/* funcion que marca que el consumidor ha terminado, para que el productor no se quede esperando */
+void ring_abandon(tring *r)
+{
+    __atomic_store_n(&r->abandoned, 1, __ATOMIC_RELEASE);
+    ring_notify(r);
+}
 
-            free(p[i]);
-        }
-        free(p);
-    }
+/* funcion que crea un lector con buffer sobre el descriptor fd */
+treader *reader_new(int fd)
+{
+    treader *r = (treader *) malloc(sizeof(treader));
 
-    // si no ejecuta en background, esperamos a la finalización normal del proceso
-    if (!line->background)
-    {
-        waitpid(pid, &status, 0);
+    r->fd = fd;
+    r->ring = NULL;
+    r->cap = READER_SIZE;
+    r->buf = (char *) malloc(r->cap);
+    r->pos = 0;
+    r->len = 0;
+    r->prev = NULL;
 
-        // para saber si el hijo hizo un exit() o no
-        if (WIFEXITED(status) != 0)
-        {
-            // si el exit() que hizo el hijo funciono o no
-            if (WEXITSTATUS(status) != 0)
-            {
-                printf("¡El comando no se ha ejecutado!\n");
-            }
-        }
-    }
-    else
-    {
-        printf(" [%d] \n", pid); // si la linea tiene background, imprime el pid del proceso sin esperar
-    }
+    return r;
 }
 
-/* funcion principal */
-int main(int argc, char *argv[])
+/* funcion que libera un lector */
+void reader_free(treader *r)
 {
-    if (argc == 1)
+    free(r->buf);
+    free(r);
+}
+
+/* funcion que devuelve la siguiente linea sin el '\n', o NULL al final de la entrada.
+   la linea apunta al buffer del lector y solo es valida hasta la siguiente lectura */
+char *reader_getline(treader *r, size_t *n)
+{
+    char *nl;
+    char *start;
+    ssize_t got;
+
+    while (1)
+    {
+        // buscamos el final de linea en lo que ya tenemos leido
+        nl = memchr(r->buf + r->pos, '\n', r->len - r->pos);
+        if (nl != NULL)
+        {
+            start = r->buf + r->pos;
+            *nl = '\0';
+            *n = nl - start;
+            r->pos = nl - r->buf + 1;
+            return start;
+        }
+
+        // movemos lo pendiente al principio y ampliamos si la linea no cabe
+        if (r->pos > 0)
+        {
+            memmove(r->buf, r->buf + r->pos, r->len - r->pos);
+            r->len -= r->pos;
+            r->pos = 0;
+        }
+        if (r->len + 1 >= r->cap)
+        {
+            r->cap *= 2;
+            r->buf = realloc(r->buf, r->cap);
+        }
+
+        got = r->ring != NULL ? ring_read(r->ring, r->buf + r->len, r->cap - r->len - 1)
+                              : read(r->fd, r->buf + r->len, r->cap - r->len - 1);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            // final de la entrada, devolvemos la ultima linea aunque no tenga '\n'
+            if (r->len == 0)
+            {
+                return NULL;
+            }
+            r->buf[r->len] = '\0';
+            *n = r->len;
+            r->pos = r->len;
+            return r->buf;
+        }
+        r->len += got;
+    }
+}
+
+/* funcion que devuelve al fichero lo que el lector ha leido de mas,
+   para que otro proceso que herede el descriptor continue donde vamos */
+void reader_sync(treader *r)
+{
+    off_t unread = r->len - r->pos;
+
+    if (unread > 0 && lseek(r->fd, -unread, SEEK_CUR) != -1)
+    {
+        r->pos = 0;
+        r->len = 0;
+    }
+}
+
+/* funcion que apila un lector nuevo sobre la entrada estandar tras redirigirla */
+void push_input()
+{
+    treader *r = reader_new(0);
+
+    r->prev = input;
+    input = r;
+}
+
+/* funcion que recupera el lector anterior de la entrada estandar */
+void pop_input()
+{
+    treader *r = input;
+
+    input = r->prev;
+    reader_free(r);
+}
+
+/* funcion que comprueba si name es un nombre de variable valido de longitud n */
+int is_name(const char *name, size_t n)
+{
+    size_t i;
+
+    if (n == 0 || !(isalpha((unsigned char) name[0]) || name[0] == '_'))
+    {
+        return 0;
+    }
+    for (i = 1; i < n; i++)
+    {
+        if (!(isalnum((unsigned char) name[i]) || name[i] == '_'))
+        {
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+/* funcion que comprueba si la palabra es una asignacion nombre=valor */
+int is_assignment(const char *word)
+{
+    const char *eq = strchr(word, '=');
+
+    return eq != NULL && is_name(word, eq - word);
+}
+
+/* funcion que busca una variable del shell, o del entorno si no existe */
+char *get_var(const char *name)
+{
+    tvar *v;
+
+    for (v = vars; v != NULL; v = v->next)
+    {
+        if (strcmp(v->name, name) == 0)
+        {
+            return v->value;
+        }
+    }
+
+    return getenv(name);
+}
+
+/* funcion que asigna una variable del shell; si existe en el entorno tambien se actualiza alli */
+void set_var(const char *name, const char *value)
+{
+    tvar *v;
+
+    if (getenv(name) != NULL)
+    {
+        setenv(name, value, 1);
+    }
+
+    for (v = vars; v != NULL; v = v->next)
+    {
+        if (strcmp(v->name, name) == 0)
+        {
+            free(v->value);
+            v->value = strdup(value);
+            return;
+        }
+    }
+
+    v = (tvar *) malloc(sizeof(tvar));
+    v->name = strdup(name);
+    v->value = strdup(value);
+    v->next = vars;
+    vars = v;
+}
+
+/* operadores binarios de las expresiones aritmeticas */
+typedef enum
+{
+    OP_OR, OP_AND, OP_BOR, OP_XOR, OP_BAND, OP_EQ, OP_NE, OP_LE, OP_GE,
+    OP_SHL, OP_SHR, OP_LT, OP_GT, OP_ADD, OP_SUB, OP_MUL, OP_DIV, OP_MOD
+} tarith_opcode;
+
+typedef struct
+{
+    const char *text;
+    tarith_opcode op;
+    int prec; // precedencia como en C: mayor numero, mayor prioridad
+} tarith_op;
+
+/* ordenados para que los operadores largos se reconozcan antes que sus prefijos */
+static const tarith_op arith_ops[] = {
+    {"||", OP_OR, 1}, {"&&", OP_AND, 2}, {"==", OP_EQ, 6}, {"!=", OP_NE, 6},
+    {"<=", OP_LE, 7}, {">=", OP_GE, 7}, {"<<", OP_SHL, 8}, {">>", OP_SHR, 8},
+    {"|", OP_BOR, 3}, {"^", OP_XOR, 4}, {"&", OP_BAND, 5}, {"<", OP_LT, 7},
+    {">", OP_GT, 7}, {"+", OP_ADD, 9}, {"-", OP_SUB, 9}, {"*", OP_MUL, 10},
+    {"/", OP_DIV, 10}, {"%", OP_MOD, 10}, {NULL, OP_OR, 0}
+};
+
+/* operadores de asignacion compuesta y el operador binario que aplican */
+static const tarith_op arith_assign_ops[] = {
+    {"<<=", OP_SHL, 0}, {">>=", OP_SHR, 0}, {"+=", OP_ADD, 0}, {"-=", OP_SUB, 0},
+    {"*=", OP_MUL, 0}, {"/=", OP_DIV, 0}, {"%=", OP_MOD, 0}, {"&=", OP_BAND, 0},
+    {"^=", OP_XOR, 0}, {"|=", OP_BOR, 0}, {"=", OP_OR, 0}, {NULL, OP_OR, 0}
+};
+
+/* estado del evaluador de expresiones aritmeticas */
+typedef struct
+{
+    const char *s;
+    const char *error;
+    int noeval; // > 0 en las ramas que no se evaluan por cortocircuito
+} tarith;
+
+static int64_t arith_comma(tarith *a);
+static int64_t arith_assign(tarith *a);
+
+/* funcion que salta los blancos de la expresion */
+static void arith_skip(tarith *a)
+{
+    while (isspace((unsigned char) *a->s))
+    {
+        a->s++;
+    }
+}
+
+/* funcion que marca el primer error de la expresion */
+static int64_t arith_fail(tarith *a, const char *error)
+{
+    if (a->error == NULL)
+    {
+        a->error = error;
+    }
+
+    return 0;
+}
+
+/* funcion que lee un nombre de variable de la expresion */
+static int arith_name(tarith *a, char name[SIZE])
+{
+    size_t n = 0;
+
+    if (!(isalpha((unsigned char) *a->s) || *a->s == '_'))
+    {
+        return 0;
+    }
+    while ((isalnum((unsigned char) *a->s) || *a->s == '_') && n < SIZE - 1)
+    {
+        name[n++] = *a->s++;
+    }
+    name[n] = '\0';
+
+    return 1;
+}
+
+/* funcion que devuelve el valor numerico de una variable; si no existe o esta vacia vale 0 */
+static int64_t arith_get(const char *name)
+{
+    char *value = get_var(name);
+
+    return value != NULL ? strtoll(value, NULL, 0) : 0;
+}
+
+/* funcion que asigna el valor a la variable salvo en las ramas que no se evaluan */
+static void arith_set(tarith *a, const char *name, int64_t value)
+{
+    char num[32];
+
+    if (a->noeval == 0)
+    {
+        snprintf(num, sizeof(num), "%lld", (long long) value);
+        set_var(name, num);
+    }
+}
+
+/* funcion que aplica un operador binario con la aritmetica de enteros de 64 bits en complemento a 2 */
+static int64_t arith_apply(tarith *a, tarith_opcode op, int64_t l, int64_t r)
+{
+    switch (op)
+    {
+        case OP_OR: return l || r;
+        case OP_AND: return l && r;
+        case OP_BOR: return l | r;
+        case OP_XOR: return l ^ r;
+        case OP_BAND: return l & r;
+        case OP_EQ: return l == r;
+        case OP_NE: return l != r;
+        case OP_LE: return l <= r;
+        case OP_GE: return l >= r;
+        case OP_LT: return l < r;
+        case OP_GT: return l > r;
+        case OP_SHL: return (int64_t) ((uint64_t) l << (r & 63));
+        case OP_SHR: return l >> (r & 63);
+        case OP_ADD: return (int64_t) ((uint64_t) l + (uint64_t) r);
+        case OP_SUB: return (int64_t) ((uint64_t) l - (uint64_t) r);
+        case OP_MUL: return (int64_t) ((uint64_t) l * (uint64_t) r);
+        case OP_DIV:
+        case OP_MOD:
+            if (r == 0)
+            {
+                return a->noeval > 0 ? 0 : arith_fail(a, "division por cero");
+            }
+            if (r == -1)
+            {
+                // evitamos el desbordamiento de INT64_MIN / -1
+                return op == OP_DIV ? (int64_t) (0 - (uint64_t) l) : 0;
+            }
+            return op == OP_DIV ? l / r : l % r;
+    }
+
+    return 0;
+}
+
+/* funcion que evalua numeros, variables (con ++ y -- detras) y parentesis */
+static int64_t arith_primary(tarith *a)
+{
+    char name[SIZE];
+    char *end;
+    int64_t value;
+
+    arith_skip(a);
+
+    if (*a->s == '(')
+    {
+        a->s++;
+        value = arith_comma(a);
+        arith_skip(a);
+        if (*a->s != ')')
+        {
+            return arith_fail(a, "falta un ')'");
+        }
+        a->s++;
+        return value;
+    }
+
+    if (isdigit((unsigned char) *a->s))
+    {
+        // strtoll con base 0 acepta decimal, octal (0...) y hexadecimal (0x...)
+        value = strtoll(a->s, &end, 0);
+        if (isalnum((unsigned char) *end) || *end == '_')
+        {
+            return arith_fail(a, "numero no valido");
+        }
+        a->s = end;
+        return value;
+    }
+
+    if (arith_name(a, name))
+    {
+        value = arith_get(name);
+        arith_skip(a);
+        if ((a->s[0] == '+' || a->s[0] == '-') && a->s[1] == a->s[0])
+        {
+            arith_set(a, name, a->s[0] == '+' ? value + 1 : value - 1);
+            a->s += 2;
+        }
+        return value;
+    }
+
+    return arith_fail(a, "se esperaba un operando");
+}
+
+/* funcion que evalua los operadores unarios - + ! ~ y los ++ y -- delante de una variable */
+static int64_t arith_unary(tarith *a)
+{
+    char name[SIZE];
+    char op;
+    int64_t value;
+
+    arith_skip(a);
+    op = *a->s;
+
+    if ((op == '+' || op == '-') && a->s[1] == op)
+    {
+        a->s += 2;
+        arith_skip(a);
+        if (!arith_name(a, name))
+        {
+            return arith_fail(a, "++ y -- necesitan una variable");
+        }
+        value = arith_get(name) + (op == '+' ? 1 : -1);
+        arith_set(a, name, value);
+        return value;
+    }
+
+    switch (op)
+    {
+        case '-':
+            a->s++;
+            return (int64_t) (0 - (uint64_t) arith_unary(a));
+        case '+':
+            a->s++;
+            return arith_unary(a);
+        case '!':
+            a->s++;
+            return !arith_unary(a);
+        case '~':
+            a->s++;
+            return ~arith_unary(a);
+    }
+
+    return arith_primary(a);
+}
+
+/* funcion que reconoce el operador binario de la posicion actual; los de asignacion (+=, <<=...) no cuentan */
+static const tarith_op *arith_operator(const char *s)
+{
+    const tarith_op *op;
+    size_t n;
+
+    for (op = arith_ops; op->text != NULL; op++)
+    {
+        n = strlen(op->text);
+        if (strncmp(s, op->text, n) == 0)
+        {
+            if (s[n] == '=' && op->op != OP_EQ && op->op != OP_NE && op->op != OP_LE && op->op != OP_GE)
+            {
+                return NULL;
+            }
+            return op;
+        }
+    }
+
+    return NULL;
+}
+
+/* funcion que evalua los operadores binarios por precedencia, con cortocircuito en && y || */
+static int64_t arith_binary(tarith *a, int min_prec)
+{
+    int64_t left = arith_unary(a);
+    int64_t right;
+    const tarith_op *op;
+    int skip;
+
+    while (a->error == NULL)
+    {
+        arith_skip(a);
+        op = arith_operator(a->s);
+        if (op == NULL || op->prec < min_prec)
+        {
+            break;
+        }
+        a->s += strlen(op->text);
+
+        // en && y || el operando derecho solo se evalua si hace falta
+        skip = (op->op == OP_AND && !left) || (op->op == OP_OR && left);
+        a->noeval += skip;
+        right = arith_binary(a, op->prec + 1);
+        a->noeval -= skip;
+
+        left = arith_apply(a, op->op, left, right);
+    }
+
+    return left;
+}
+
+/* funcion que evalua el operador condicional c ? a : b */
+static int64_t arith_ternary(tarith *a)
+{
+    int64_t cond = arith_binary(a, 1);
+    int64_t yes;
+    int64_t no;
+
+    arith_skip(a);
+    if (*a->s != '?')
+    {
+        return cond;
+    }
+    a->s++;
+
+    a->noeval += !cond;
+    yes = arith_assign(a);
+    a->noeval -= !cond;
+
+    arith_skip(a);
+    if (*a->s != ':')
+    {
+        return arith_fail(a, "falta ':' en el operador ?:");
+    }
+    a->s++;
+
+    a->noeval += !!cond;
+    no = arith_ternary(a);
+    a->noeval -= !!cond;
+
+    return cond ? yes : no;
+}
+
+/* funcion que evalua las asignaciones: = += -= *= /= %= <<= >>= &= ^= |= */
+static int64_t arith_assign(tarith *a)
+{
+    const char *save;
+    const tarith_op *op;
+    char name[SIZE];
+    int64_t value;
+    size_t n;
+
+    arith_skip(a);
+    save = a->s;
+
+    if (arith_name(a, name))
+    {
+        arith_skip(a);
+        for (op = arith_assign_ops; op->text != NULL; op++)
+        {
+            n = strlen(op->text);
+            if (strncmp(a->s, op->text, n) == 0 && a->s[n] != '=')
+            {
+                a->s += n;
+                value = arith_assign(a);
+                if (n > 1)
+                {
+                    value = arith_apply(a, op->op, arith_get(name), value);
+                }
+                arith_set(a, name, value);
+                return value;
+            }
+        }
+    }
+
+    a->s = save;
+    return arith_ternary(a);
+}
+
+/* funcion que evalua expresiones separadas por comas, el valor es el de la ultima */
+static int64_t arith_comma(tarith *a)
+{
+    int64_t value = arith_assign(a);
+
+    while (a->error == NULL)
+    {
+        arith_skip(a);
+        if (*a->s != ',')
+        {
+            break;
+        }
+        a->s++;
+        value = arith_assign(a);
+    }
+
+    return value;
+}
+
+/* funcion que evalua una expresion aritmetica con enteros de 64 bits; devuelve 0 si es correcta */
+int arith_eval(const char *expr, int64_t *result)
+{
+    tarith a = {expr, NULL, 0};
+
+    // una expresion vacia vale 0
+    arith_skip(&a);
+    *result = *a.s == '\0' ? 0 : arith_comma(&a);
+
+    arith_skip(&a);
+    if (a.error == NULL && *a.s != '\0')
+    {
+        a.error = "sobra texto en la expresion";
+    }
+    if (a.error != NULL)
+    {
+        fprintf(stderr, "Error en la expresion aritmetica \"%s\": %s\n", expr, a.error);
+        return 1;
+    }
+
+    return 0;
+}
+
+/* funcion que devuelve la longitud del parentesis que abre en s hasta el que lo cierra, o 0 si no se cierra */
+size_t paren_length(const char *s)
+{
+    const char *p = s + 1;
+    int depth = 1;
+    char quote = 0;
+
+    for (; *p != '\0'; p++)
+    {
+        if (quote != 0)
+        {
+            if (*p == quote)
+            {
+                quote = 0;
+            }
+        }
+        else if (*p == '\'' || *p == '"')
+        {
+            quote = *p;
+        }
+        else if (*p == '(')
+        {
+            depth++;
+        }
+        else if (*p == ')' && --depth == 0)
+        {
+            return p - s + 1;
+        }
+    }
+
+    return 0;
+}
+
+/* funcion que devuelve la longitud de un `comandos` incluidas las comillas, o 0 si no se cierra */
+size_t backquote_length(const char *s)
+{
+    const char *end = strchr(s + 1, '`');
+
+    return end != NULL ? end - s + 1 : 0;
+}
+
+/* funcion que convierte `comandos` de longitud n en $(comandos) */
+char *backquote_to_subst(const char *s, size_t n)
+{
+    char *subst = (char *) malloc(n + 2);
+
+    subst[0] = '$';
+    subst[1] = '(';
+    memcpy(subst + 2, s + 1, n - 2);
+    subst[n] = ')';
+    subst[n + 1] = '\0';
+
+    return subst;
+}
+
+/* funcion que devuelve la longitud de un texto entre comillas, incluidas ellas, o 0 si no se cierra.
+   entre comillas dobles se saltan las sustituciones, que pueden tener sus propias comillas */
+size_t quote_length(const char *s)
+{
+    const char *p = s + 1;
+    size_t n;
+
+    if (*s == '\'')
+    {
+        p = strchr(p, '\'');
+        return p != NULL ? p - s + 1 : 0;
+    }
+
+    while (*p != '\0' && *p != '"')
+    {
+        if (p[0] == '$' && p[1] == '(' && (n = paren_length(p + 1)) > 0)
+        {
+            p += n + 1;
+        }
+        else if (*p == '`' && (n = backquote_length(p)) > 0)
+        {
+            p += n;
+        }
+        else
+        {
+            p++;
+        }
+    }
+
+    return *p == '"' ? p - s + 1 : 0;
+}
+
+/* funcion que ejecuta los comandos de una sustitucion $( ) y devuelve su salida sin los '\n' finales.
+   la salida estandar se lleva a un memfd mientras se ejecutan, asi los builtins escriben en el
+   sin hacer fork, los comandos externos pasan por execute_command() como siempre y no hay
+   bloqueo aunque la salida no quepa en una tuberia */
+char *command_subst(const char *text)
+{
+    tbuffer out = {NULL, 0, 0};
+    struct stat st;
+    tnode *list;
+    ssize_t got;
+    int status;
+    int saved;
+    int fd;
+
+    buffer_append(&out, "", 0);
+
+    list = parse_text(text, &status);
+    if (status != PARSE_OK)
+    {
+        fprintf(stderr, "Error de sintaxis en la sustitucion $(%s)\n", text);
+        free_node(list);
+        expand_failed = 1;
+        return out.data;
+    }
+
+    fd = memfd_create("msh-subst", MFD_CLOEXEC);
+    if (fd == -1)
+    {
+        fprintf(stderr, "Error al crear el buffer de la sustitucion: %s\n", strerror(errno));
+        free_node(list);
+        expand_failed = 1;
+        return out.data;
+    }
+
+    fflush(stdout);
+    saved = fcntl(1, F_DUPFD_CLOEXEC, 10);
+    dup2(fd, 1);
+
+    subst_depth++;
+    execute_list(list);
+    subst_depth--;
+    subst_ran = 1;
+    subst_exit = 0;
+
+    fflush(stdout);
+    dup2(saved, 1);
+    close(saved);
+    free_node(list);
+
+    // leemos toda la salida de una vez, ya sabemos cuanto ocupa
+    if (fstat(fd, &st) == 0 && st.st_size > 0)
+    {
+        out.cap = st.st_size + 1;
+        out.data = realloc(out.data, out.cap);
+        while (out.len < (size_t) st.st_size)
+        {
+            got = pread(fd, out.data + out.len, st.st_size - out.len, out.len);
+            if (got <= 0)
+            {
+                break;
+            }
+            out.len += got;
+        }
+    }
+    close(fd);
+
+    while (out.len > 0 && out.data[out.len - 1] == '\n')
+    {
+        out.len--;
+    }
+    out.data[out.len] = '\0';
+
+    return out.data;
+}
+
+char *expand_word(const char *word, const tvec *subst);
+
+/* funcion que expande un texto que extract_substs() saco del comando: un $( ), un texto entre
+   comillas simples, que queda tal cual, o entre comillas dobles, que se expande. sin las comillas */
+char *expand_subst(const char *text)
+{
+    char *inner;
+    char *value;
+
+    if (*text == '\'')
+    {
+        return strndup(text + 1, strlen(text) - 2);
+    }
+    if (*text != '"')
+    {
+        return expand_word(text, NULL);
+    }
+
+    inner = strndup(text + 1, strlen(text) - 2);
+    value = expand_word(inner, NULL);
+    free(inner);
+
+    return value;
+}
+
+/* funcion que expande las variables ($nombre, ${nombre}, $? y $$), las expresiones aritmeticas
+   $(( )) y las sustituciones $( ) de una palabra; subst son las expansiones sacadas del texto original */
+char *expand_word(const char *word, const tvec *subst)
+{
+    tbuffer b = {NULL, 0, 0};
+    const char *p = word;
+    const char *start;
+    const char *dollar;
+    char name[SIZE];
+    char num[32];
+    char *value;
+    char *end;
+    size_t n;
+    long index;
+    int64_t result;
+
+    buffer_append(&b, "", 0);
+
+    while (*p != '\0')
+    {
+        if (*p != '$')
+        {
+            if (*p == '`' && (n = backquote_length(p)) > 0)
+            {
+                // `comandos` dentro de comillas dobles, los de fuera ya se cambiaron por una marca
+                value = strndup(p + 1, n - 2);
+                end = command_subst(value);
+                buffer_append(&b, end, strlen(end));
+                free(end);
+                free(value);
+                p += n;
+                continue;
+            }
+
+            // copiamos de una vez todo el texto hasta el siguiente '$' o '`'
+            start = p++;
+            while (*p != '\0' && *p != '$' && *p != '`')
+            {
+                p++;
+            }
+            buffer_append(&b, start, p - start);
+            continue;
+        }
+
+        dollar = p++;
+        if (*p == '?' || *p == '$')
+        {
+            snprintf(num, sizeof(num), "%d", *p == '?' ? last_status : (int) getpid());
+            buffer_append(&b, num, strlen(num));
+            p++;
+            continue;
+        }
+
+        if ((*p == SUBST_MARK || *p == SUBST_QUOTED) && subst != NULL)
+        {
+            // expansion que se saco del texto antes de tokenizarlo
+            index = strtol(p + 1, &end, 10);
+            if (*end == *p && index >= 0 && index < subst->len)
+            {
+                value = expand_subst(subst->items[index]);
+                buffer_append(&b, value, strlen(value));
+                free(value);
+                p = end + 1;
+                continue;
+            }
+        }
+
+        if (p[0] == '(' && p[1] == '(' && (n = paren_length(p)) > 0 && p[n - 2] == ')')
+        {
+            // $(( expresion )): primero se expanden sus variables y luego se evalua
+            value = strndup(p + 2, n - 4);
+            end = expand_word(value, NULL);
+            if (arith_eval(end, &result) != 0)
+            {
+                expand_failed = 1;
+            }
+            else
+            {
+                snprintf(num, sizeof(num), "%lld", (long long) result);
+                buffer_append(&b, num, strlen(num));
+            }
+            free(end);
+            free(value);
+            p += n;
+            continue;
+        }
+
+        if (p[0] == '(' && (n = paren_length(p)) > 0)
+        {
+            // $( comandos ): se sustituye por su salida
+            value = strndup(p + 1, n - 2);
+            end = command_subst(value);
+            buffer_append(&b, end, strlen(end));
+            free(end);
+            free(value);
+            p += n;
+            continue;
+        }
+
+        if (*p == '{')
+        {
+            start = ++p;
+            while (*p != '\0' && *p != '}')
+            {
+                p++;
+            }
+            n = p - start;
+            if (*p == '}')
+            {
+                p++;
+            }
+        }
+        else
+        {
+            start = p;
+            while (isalnum((unsigned char) *p) || *p == '_')
+            {
+                p++;
+            }
+            n = p - start;
+        }
+
+        // un '$' que no va seguido de un nombre se deja tal cual
+        if (!is_name(start, n) || n >= SIZE)
+        {
+            buffer_append(&b, "$", 1);
+            p = dollar + 1;
+            continue;
+        }
+
+        memcpy(name, start, n);
+        name[n] = '\0';
+        value = get_var(name);
+        if (value != NULL)
+        {
+            buffer_append(&b, value, strlen(value));
+        }
+    }
+
+    return b.data;
+}
+
+/* funcion que parte el valor en campos separados por blancos y los añade a fields */
+void split_fields(const char *value, tvec *fields)
+{
+    const char *p = value;
+    const char *start;
+
+    while (*p != '\0')
+    {
+        while (*p == ' ' || *p == '\t' || *p == '\n')
+        {
+            p++;
+        }
+        if (*p == '\0')
+        {
+            break;
+        }
+        start = p;
+        while (*p != '\0' && *p != ' ' && *p != '\t' && *p != '\n')
+        {
+            p++;
+        }
+        vec_push(fields, strndup(start, p - start));
+    }
+}
+
+/* funcion que expande una palabra de un bloque de control con las mismas comillas que un comando
+   simple; si quoted no es NULL indica si tenia alguna parte entre comillas */
+char *expand_control_word(const char *word, int *quoted)
+{
+    tbuffer text = {NULL, 0, 0};
+    tvec subst = {NULL, 0, 0};
+    char *value;
+
+    extract_substs(word, strlen(word), &text, &subst);
+    buffer_append(&text, "", 0);
+    value = expand_word(text.data, &subst);
+    if (quoted != NULL)
+    {
+        *quoted = strchr(text.data, SUBST_QUOTED) != NULL;
+    }
+
+    free(text.data);
+    vec_free(&subst);
+
+    return value;
+}
+
+/* funcion que expande una palabra y la parte en campos separados por blancos, salvo que tenga comillas */
+void expand_fields(const char *word, tvec *fields)
+{
+    int quoted;
+    char *value = expand_control_word(word, &quoted);
+
+    if (quoted)
+    {
+        vec_push(fields, value);
+        return;
+    }
+
+    split_fields(value, fields);
+    free(value);
+}
+
+/* funcion que copia una cadena en el bloque de un tline empaquetado */
+static char *pack_string(char **cursor, const char *s)
+{
+    char *dst;
+    size_t n;
+
+    if (s == NULL)
+    {
+        return NULL;
+    }
+
+    n = strlen(s) + 1;
+    dst = *cursor;
+    memcpy(dst, s, n);
+    *cursor += n;
+
+    return dst;
+}
+
+/* funcion que calcula el tamaño de un tline empaquetado: estructuras, vectores de argumentos y cadenas */
+size_t tline_size(const tline *src)
+{
+    size_t size;
+    int i;
+    int j;
+
+    size = sizeof(tline) + src->ncommands * sizeof(tcommand);
+    for (i = 0; i < src->ncommands; i++)
+    {
+        size += (src->commands[i].argc + 1) * sizeof(char *);
+        size += src->commands[i].filename != NULL ? strlen(src->commands[i].filename) + 1 : 0;
+        for (j = 0; j < src->commands[i].argc; j++)
+        {
+            size += strlen(src->commands[i].argv[j]) + 1;
+        }
+    }
+    size += src->redirect_input != NULL ? strlen(src->redirect_input) + 1 : 0;
+    size += src->redirect_output != NULL ? strlen(src->redirect_output) + 1 : 0;
+    size += src->redirect_error != NULL ? strlen(src->redirect_error) + 1 : 0;
+
+    return size;
+}
+
+/* funcion que empaqueta un tline en el bloque dst, de tline_size(src) bytes */
+void pack_tline(tline *dst, const tline *src)
+{
+    int i;
+    int j;
+    char *block = (char *) dst;
+    char *strings;
+    char **argv;
+
+    dst->ncommands = src->ncommands;
+    dst->commands = (tcommand *) (block + sizeof(tline));
+    dst->background = src->background;
+
+    argv = (char **) (dst->commands + src->ncommands);
+    strings = (char *) argv;
+    for (i = 0; i < src->ncommands; i++)
+    {
+        strings += (src->commands[i].argc + 1) * sizeof(char *);
+    }
+
+    for (i = 0; i < src->ncommands; i++)
+    {
+        dst->commands[i].argc = src->commands[i].argc;
+        dst->commands[i].argv = argv;
+        dst->commands[i].filename = pack_string(&strings, src->commands[i].filename);
+        for (j = 0; j < src->commands[i].argc; j++)
+        {
+            argv[j] = pack_string(&strings, src->commands[i].argv[j]);
+        }
+        argv[j] = NULL;
+        argv += j + 1;
+    }
+    dst->redirect_input = pack_string(&strings, src->redirect_input);
+    dst->redirect_output = pack_string(&strings, src->redirect_output);
+    dst->redirect_error = pack_string(&strings, src->redirect_error);
+}
+
+/* funcion que copia un tline en un unico bloque de memoria, que se libera con free().
+   tokenize() reutiliza su memoria en cada llamada, asi que hay que copiarlo para conservarlo */
+tline *copy_tline(const tline *src)
+{
+    tline *dst = (tline *) malloc(tline_size(src));
+
+    pack_tline(dst, src);
+
+    return dst;
+}
+
+/* funcion hash FNV-1a del texto de una linea */
+uint64_t hash_text(const char *s, size_t n)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t i;
+
+    for (i = 0; i < n; i++)
+    {
+        hash = (hash ^ (unsigned char) s[i]) * 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+/* funcion que saca una entrada de la lista LRU */
+void cache_unlink(tcached *entry)
+{
+    if (entry->newer != NULL)
+    {
+        entry->newer->older = entry->older;
+    }
+    else
+    {
+        cache_newest = entry->older;
+    }
+    if (entry->older != NULL)
+    {
+        entry->older->newer = entry->newer;
+    }
+    else
+    {
+        cache_oldest = entry->newer;
+    }
+}
+
+/* funcion que pone una entrada la primera de la lista LRU */
+void cache_touch(tcached *entry)
+{
+    entry->newer = NULL;
+    entry->older = cache_newest;
+    if (cache_newest != NULL)
+    {
+        cache_newest->newer = entry;
+    }
+    cache_newest = entry;
+    if (cache_oldest == NULL)
+    {
+        cache_oldest = entry;
+    }
+}
+
+/* funcion que expulsa una entrada de la cache; si algun nodo la usa se libera al soltarla */
+void cache_evict(tcached *entry)
+{
+    tcached **link = &cache_buckets[entry->hash & (CACHE_BUCKETS - 1)];
+
+    while (*link != entry)
+    {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    cache_unlink(entry);
+
+    cache_entries--;
+    cache_bytes -= entry->size;
+    entry->evicted = 1;
+    if (entry->refs == 0)
+    {
+        free(entry);
+    }
+}
+
+/* funcion que vacia la cache de lineas */
+void cache_clear()
+{
+    while (cache_oldest != NULL)
+    {
+        cache_evict(cache_oldest);
+    }
+}
+
+/* funcion que suelta una entrada que usaba un nodo */
+void cache_release(tcached *entry)
+{
+    entry->refs--;
+    if (entry->refs == 0 && entry->evicted)
+    {
+        free(entry);
+    }
+}
+
+/* funcion que busca el texto de una linea en la cache y devuelve su entrada, ya reservada para el nodo.
+   los comandos se resolvieron con el PATH de entonces, asi que si ha cambiado se vacia la cache */
+tcached *cache_lookup(const char *text, size_t len, uint64_t hash)
+{
+    const char *path = getenv("PATH");
+    tcached *entry;
+
+    if (path == NULL)
+    {
+        path = "";
+    }
+    if (cache_path == NULL || strcmp(cache_path, path) != 0)
+    {
+        cache_clear();
+        free(cache_path);
+        cache_path = strdup(path);
+    }
+
+    for (entry = cache_buckets[hash & (CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next)
+    {
+        if (entry->hash == hash && entry->len == len && memcmp(entry->text, text, len) == 0)
+        {
+            cache_unlink(entry);
+            cache_touch(entry);
+            entry->refs++;
+            cache_hits++;
+            return entry;
+        }
+    }
+    cache_misses++;
+
+    return NULL;
+}
+
+/* funcion que indica si un comando tokenizado se puede guardar en la cache: no lo es si no se ha
+   encontrado o se ha resuelto con una ruta relativa, que dependen de ficheros que aun no existen o
+   del directorio actual. los mandatos internos, asignaciones y nombres con '$' no se resuelven */
+int cacheable_command(const tcommand *command)
+{
+    if (command->filename != NULL)
+    {
+        return command->filename[0] == '/';
+    }
+
+    return strchr(command->argv[0], '$') != NULL || is_assignment(command->argv[0])
+        || find_builtin(command->argv[0]) != NULL;
+}
+
+/* funcion que guarda en la cache una linea recien tokenizada y devuelve su entrada, ya reservada
+   para el nodo, o NULL si la linea no se puede guardar */
+tcached *cache_insert(const char *text, size_t len, uint64_t hash, const tline *line)
+{
+    tcached *entry;
+    size_t size;
+    size_t offset;
+    int i;
+
+    for (i = 0; i < line->ncommands; i++)
+    {
+        if (!cacheable_command(&line->commands[i]))
+        {
+            return NULL;
+        }
+    }
+
+    // el tline empaquetado va detras del texto, en el mismo bloque
+    offset = (sizeof(tcached) + len + 1 + _Alignof(tline) - 1) & ~(_Alignof(tline) - 1);
+    size = offset + tline_size(line);
+    if (size > CACHE_BYTES / 4)
+    {
+        return NULL;
+    }
+
+    while (cache_entries >= CACHE_ENTRIES || cache_bytes + size > CACHE_BYTES)
+    {
+        cache_evict(cache_oldest);
+    }
+
+    entry = (tcached *) malloc(size);
+    entry->hash = hash;
+    entry->len = len;
+    entry->size = size;
+    entry->refs = 1;
+    entry->evicted = 0;
+    memcpy(entry->text, text, len);
+    entry->text[len] = '\0';
+
+    entry->line = (tline *) ((char *) entry + offset);
+    pack_tline(entry->line, line);
+
+    entry->next = cache_buckets[hash & (CACHE_BUCKETS - 1)];
+    cache_buckets[hash & (CACHE_BUCKETS - 1)] = entry;
+    cache_touch(entry);
+    cache_entries++;
+    cache_bytes += size;
+
+    return entry;
+}
+
+/* funcion que crea una copia del tline con las variables de cada palabra expandidas */
+tline *expand_line(const tline *src, const tvec *subst)
+{
+    tline *dst = (tline *) calloc(1, sizeof(tline));
+    tcommand *cmd;
+    tvec fields;
+    char *value;
+    int i;
+    int j;
+
+    dst->ncommands = src->ncommands;
+    dst->commands = (tcommand *) calloc(src->ncommands, sizeof(tcommand));
+    dst->background = src->background;
+
+    for (i = 0; i < src->ncommands; i++)
+    {
+        cmd = &dst->commands[i];
+        fields.items = NULL;
+        fields.len = 0;
+        fields.cap = 0;
+
+        for (j = 0; j < src->commands[i].argc; j++)
+        {
+            value = expand_word(src->commands[i].argv[j], subst);
+
+            // la salida de una sustitucion fuera de comillas se parte en varias palabras,
+            // salvo en las asignaciones y en las palabras con una parte entre comillas
+            if (strchr(src->commands[i].argv[j], SUBST_MARK) != NULL && strchr(src->commands[i].argv[j], SUBST_QUOTED) == NULL
+                    && !is_assignment(src->commands[i].argv[j]))
+            {
+                split_fields(value, &fields);
+                free(value);
+            }
+            else
+            {
+                vec_push(&fields, value);
+            }
+        }
+
+        // solo se permite que el comando se quede sin palabras si va solo en la linea
+        if (fields.len == 0 && src->ncommands > 1)
+        {
+            vec_push(&fields, strdup(""));
+        }
+        vec_push(&fields, NULL);
+        cmd->argc = fields.len - 1;
+        cmd->argv = fields.items;
+
+        if (cmd->argc == 0)
+        {
+            continue;
+        }
+
+        // filename solo es la ruta que resolvio tokenize(), una pista para la precarga: execvp() busca
+        // el comando al ejecutarlo. si el nombre venia de una variable la pista es el propio nombre
+        if (strcmp(cmd->argv[0], src->commands[i].argv[0]) != 0)
+        {
+            cmd->filename = strdup(cmd->argv[0]);
+        }
+        else if (src->commands[i].filename != NULL)
+        {
+            cmd->filename = strdup(src->commands[i].filename);
+        }
+    }
+
+    dst->redirect_input = src->redirect_input != NULL ? expand_word(src->redirect_input, subst) : NULL;
+    dst->redirect_output = src->redirect_output != NULL ? expand_word(src->redirect_output, subst) : NULL;
+    dst->redirect_error = src->redirect_error != NULL ? expand_word(src->redirect_error, subst) : NULL;
+
+    return dst;
+}
+
+/* funcion que libera un tline creado por expand_line() */
+void free_expanded_line(tline *line)
+{
+    int i;
+    int j;
+
+    for (i = 0; i < line->ncommands; i++)
+    {
+        for (j = 0; j < line->commands[i].argc; j++)
+        {
+            free(line->commands[i].argv[j]);
+        }
+        free(line->commands[i].argv);
+        free(line->commands[i].filename);
+    }
+    free(line->commands);
+    free(line->redirect_input);
+    free(line->redirect_output);
+    free(line->redirect_error);
+    free(line);
+}
+
+/* funcion que lee de un ELF de 64 bits el bloque [offset, offset + size) en memoria nueva, NULL si no puede */
+void *elf_read(int fd, uint64_t offset, uint64_t size)
+{
+    void *data;
+
+    if (size == 0 || size > (1 << 20))
+    {
+        return NULL;
+    }
+
+    data = malloc(size + 1);
+    if (pread(fd, data, size, offset) != (ssize_t) size)
+    {
+        free(data);
+        return NULL;
+    }
+    ((char *) data)[size] = '\0';
+
+    return data;
+}
+
+/* funcion que busca una biblioteca como lo haria el cargador: LD_LIBRARY_PATH y los directorios del sistema */
+char *find_library(const char *name)
+{
+    static const char *system_dirs = "/lib64:/usr/lib64:/lib/" MULTIARCH ":/usr/lib/" MULTIARCH ":/lib:/usr/lib";
+    const char *lists[2] = {getenv("LD_LIBRARY_PATH"), system_dirs};
+    const char *dir;
+    const char *end;
+    char path[SIZE];
+    int i;
+
+    if (strchr(name, '/') != NULL)
+    {
+        return access(name, R_OK) == 0 ? strdup(name) : NULL;
+    }
+
+    for (i = 0; i < 2; i++)
+    {
+        for (dir = lists[i]; dir != NULL && *dir != '\0'; dir = *end != '\0' ? end + 1 : end)
+        {
+            end = strchrnul(dir, ':');
+            snprintf(path, sizeof(path), "%.*s/%s", (int) (end - dir), dir, name);
+            if (end > dir && access(path, R_OK) == 0)
+            {
+                return strdup(path);
+            }
+        }
+    }
+
+    return NULL;
+}
+
+/* funcion que añade a deps el interprete y las bibliotecas DT_NEEDED de un ejecutable ELF de 64 bits */
+void elf_dependencies(const char *file, tvec *deps)
+{
+    Elf64_Ehdr ehdr;
+    Elf64_Phdr *phdr = NULL;
+    Elf64_Dyn *dyn = NULL;
+    char *strtab = NULL;
+    char *interp;
+    char *lib;
+    uint64_t strtab_addr = 0;
+    uint64_t strtab_size = 0;
+    size_t ndyn = 0;
+    int i;
+    int j;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        return;
+    }
+
+    if (pread(fd, &ehdr, sizeof(ehdr), 0) != sizeof(ehdr) || memcmp(ehdr.e_ident, ELFMAG, SELFMAG) != 0
+            || ehdr.e_ident[EI_CLASS] != ELFCLASS64 || ehdr.e_phentsize != sizeof(Elf64_Phdr)
+            || (phdr = elf_read(fd, ehdr.e_phoff, ehdr.e_phnum * sizeof(Elf64_Phdr))) == NULL)
+    {
+        close(fd);
+        return;
+    }
+
+    for (i = 0; i < ehdr.e_phnum; i++)
+    {
+        if (phdr[i].p_type == PT_INTERP && (interp = elf_read(fd, phdr[i].p_offset, phdr[i].p_filesz)) != NULL)
+        {
+            vec_push(deps, interp);
+        }
+        else if (phdr[i].p_type == PT_DYNAMIC && dyn == NULL)
+        {
+            dyn = elf_read(fd, phdr[i].p_offset, phdr[i].p_filesz);
+            ndyn = dyn != NULL ? phdr[i].p_filesz / sizeof(Elf64_Dyn) : 0;
+        }
+    }
+
+    for (i = 0; i < (int) ndyn && dyn[i].d_tag != DT_NULL; i++)
+    {
+        if (dyn[i].d_tag == DT_STRTAB)
+        {
+            strtab_addr = dyn[i].d_un.d_ptr;
+        }
+        else if (dyn[i].d_tag == DT_STRSZ)
+        {
+            strtab_size = dyn[i].d_un.d_val;
+        }
+    }
+
+    // DT_STRTAB es una direccion virtual, la pasamos a posicion en el fichero con su PT_LOAD
+    for (j = 0; j < ehdr.e_phnum && strtab == NULL && strtab_addr != 0; j++)
+    {
+        if (phdr[j].p_type == PT_LOAD && strtab_addr >= phdr[j].p_vaddr
+                && strtab_addr < phdr[j].p_vaddr + phdr[j].p_filesz)
+        {
+            strtab = elf_read(fd, strtab_addr - phdr[j].p_vaddr + phdr[j].p_offset, strtab_size);
+        }
+    }
+
+    for (i = 0; i < (int) ndyn && dyn[i].d_tag != DT_NULL && strtab != NULL; i++)
+    {
+        if (dyn[i].d_tag == DT_NEEDED && dyn[i].d_un.d_val < strtab_size
+                && (lib = find_library(strtab + dyn[i].d_un.d_val)) != NULL)
+        {
+            vec_push(deps, lib);
+        }
+    }
+
+    free(strtab);
+    free(dyn);
+    free(phdr);
+    close(fd);
+}
+
+/* funcion que pide al kernel que lea un fichero entero a la cache de paginas sin esperarlo */
+void prefetch_file(const char *file)
+{
+    int fd = open(file, O_RDONLY | O_CLOEXEC | O_NOATIME);
+
+    if (fd == -1)
+    {
+        fd = open(file, O_RDONLY | O_CLOEXEC);
+    }
+    if (fd != -1)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+        close(fd);
+    }
+}
+
+/* funcion que precarga un ejecutable y sus dependencias si no se ha hecho en los ultimos
+   PREFETCH_INTERVAL segundos, se haya lanzado o no desde entonces. typed indica que la pide
+   el nombre que se esta escribiendo */
+void prefetch_warm(tprefetch *p, int typed)
+{
+    time_t now = time(NULL);
+    int i;
+
+    if (now - p->warmed < PREFETCH_INTERVAL)
+    {
+        return;
+    }
+
+    if (!p->resolved)
+    {
+        elf_dependencies(p->path, &p->deps);
+        p->resolved = 1;
+    }
+
+    prefetch_file(p->path);
+    for (i = 0; i < p->deps.len; i++)
+    {
+        prefetch_file(p->deps.items[i]);
+    }
+    p->pending = 1;
+    p->typed = typed;
+    p->warmed = now;
+}
+
+/* funcion que cuenta un lanzamiento de un ejecutable ya resuelto */
+void prefetch_count(const char *path)
+{
+    tprefetch *p;
+
+    if (path == NULL || path[0] != '/')
+    {
+        return;
+    }
+
+    for (p = launched; p != NULL && strcmp(p->path, path) != 0; p = p->next)
+    {
+    }
+    if (p == NULL)
+    {
+        p = (tprefetch *) calloc(1, sizeof(tprefetch));
+        p->path = strdup(path);
+        p->next = launched;
+        launched = p;
+    }
+
+    // la precarga del prompt justo antes de lanzarlo no demuestra nada: solo es un acierto si la
+    // pidio el nombre escrito o se hizo con tiempo de terminar antes del lanzamiento
+    p->launches++;
+    if (p->pending && (p->typed || time(NULL) - p->warmed >= PREFETCH_LEAD))
+    {
+        p->hits++;
+    }
+    p->pending = 0;
+}
+
+/* funcion que indica si un ejecutable esta entre los PREFETCH_HOT mas lanzados (al menos dos veces) */
+int prefetch_is_hot(const tprefetch *p)
+{
+    const tprefetch *q;
+    int above = 0;
+
+    for (q = launched; q != NULL; q = q->next)
+    {
+        if (q->launches > p->launches || (q->launches == p->launches && strcmp(q->path, p->path) < 0))
+        {
+            above++;
+        }
+    }
+
+    return p->launches >= 2 && above < PREFETCH_HOT;
+}
+
+/* funcion que precarga los ejecutables mas lanzados; se llama cuando el shell espera una linea */
+void prefetch_hot()
+{
+    tprefetch *p;
+
+    for (p = launched; p != NULL; p = p->next)
+    {
+        if (prefetch_is_hot(p))
+        {
+            prefetch_warm(p, 0);
+        }
+    }
+}
+
+/* funcion que precarga el ejecutable mas lanzado cuyo nombre empieza por lo que se esta escribiendo */
+void prefetch_prefix(const char *prefix, size_t n)
+{
+    tprefetch *best = NULL;
+    tprefetch *p;
+    const char *name;
+
+    for (p = launched; p != NULL; p = p->next)
+    {
+        name = strrchr(p->path, '/') + 1;
+        if (strncmp(name, prefix, n) == 0 && (best == NULL || p->launches > best->launches))
+        {
+            best = p;
+        }
+    }
+
+    if (best != NULL)
+    {
+        prefetch_warm(best, 1);
+    }
+}
+
+/* funcion que escribe n bytes en fd aunque write() los acepte por partes; -1 si falla */
+int write_all(int fd, const char *s, size_t n)
+{
+    ssize_t done;
+
+    while (n > 0)
+    {
+        done = write(fd, s, n);
+        if (done < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (done <= 0)
+        {
+            return -1;
+        }
+        s += done;
+        n -= done;
+    }
+
+    return 0;
+}
+
+/* funcion que escribe la salida de un builtin: a stdout, o a la salida de la etapa si es un hilo.
+   en un hilo se ignora que la salida este cerrada, como haria un proceso que recibe SIGPIPE */
+void shell_write(const char *s, size_t n)
+{
+    if (current_stage == NULL)
+    {
+        fwrite(s, 1, n, stdout);
+        return;
+    }
+
+    if (current_stage->out != NULL)
+    {
+        ring_write(current_stage->out, s, n);
+        return;
+    }
+
+    write_all(current_stage->out_fd, s, n);
+}
+
+/* funcion ejecutar el comando cd */
+int builtin_cd(int argc, char **argv)
+{
+    // variables
+    char dir[SIZE];
+    char *home;
+
+    // comprobamos si el comando es "cd" o "cd" con argumentos
+    if (argc == 1)
+    {
+        home = getenv("HOME"); // apuntamos al directorio HOME solo si es 1 argumento
+        if (home == NULL)
+        {
+            fprintf(stderr, "No existe la variable $HOME\n"); // no existe
+            return 1;
+        }
+        snprintf(dir, SIZE, "%s", home);
+    }
+    else
+    {
+        snprintf(dir, SIZE, "%s", argv[1]); // apuntamos al directorio del parametro si solo son 2 argumentos
+    }
+
+    // cambiamos de directorio y lo imprimimos
+    if (chdir(dir) != 0)
+    {
+        fprintf(stderr, "Error al cambiar de directorio: %s\n", strerror(errno));
+        return 1;
+    }
+
+    // imprimimos el directorio actual
+    printf("El directorio actual es: %s\n", getcwd(dir, SIZE));
+
+    return 0;
+}
+
+/* funcion ejecutar el comando exit */
+int builtin_exit(int argc, char **argv)
+{
+    // dentro de una sustitucion solo termina la sustitucion, no el shell
+    if (subst_depth > 0)
+    {
+        subst_exit = 1;
+        return argc > 1 ? atoi(argv[1]) : 0;
+    }
+
+    run = 0;
+    exit(argc > 1 ? atoi(argv[1]) : 0);
+}
+
+/* funcion ejecutar el comando echo */
+int builtin_echo(int argc, char **argv)
+{
+    int i = 1;
+    int newline = 1;
+
+    if (argc > 1 && strcmp(argv[1], "-n") == 0)
+    {
+        newline = 0;
+        i++;
+    }
+
+    for (; i < argc; i++)
+    {
+        shell_write(argv[i], strlen(argv[i]));
+        if (i < argc - 1)
+        {
+            shell_write(" ", 1);
+        }
+    }
+    if (newline)
+    {
+        shell_write("\n", 1);
+    }
+
+    return 0;
+}
+
+/* funcion ejecutar el comando true */
+int builtin_true(int argc, char **argv)
+{
+    (void) argc;
+    (void) argv;
+
+    return 0;
+}
+
+/* funcion ejecutar el comando false */
+int builtin_false(int argc, char **argv)
+{
+    (void) argc;
+    (void) argv;
+
+    return 1;
+}
+
+/* funcion ejecutar el comando read: lee una linea de la entrada y la reparte entre las variables */
+int builtin_read(int argc, char **argv)
+{
+    char *line;
+    char *p;
+    char *start;
+    char *end;
+    size_t n;
+    int i = 1;
+
+    // las barras invertidas no se interpretan, asi que -r se acepta sin hacer nada
+    if (argc > 1 && strcmp(argv[1], "-r") == 0)
+    {
+        i++;
+    }
+
+    line = reader_getline(input, &n);
+    if (line == NULL)
+    {
+        return 1;
+    }
+
+    if (i == argc)
+    {
+        set_var("REPLY", line);
+        return 0;
+    }
+
+    p = line;
+    for (; i < argc; i++)
+    {
+        while (*p == ' ' || *p == '\t')
+        {
+            p++;
+        }
+        start = p;
+
+        if (i == argc - 1)
+        {
+            // la ultima variable se queda con el resto de la linea sin los blancos finales
+            end = line + n;
+            while (end > start && (end[-1] == ' ' || end[-1] == '\t'))
+            {
+                end--;
+            }
+        }
+        else
+        {
+            while (*p != '\0' && *p != ' ' && *p != '\t')
+            {
+                p++;
+            }
+            end = p;
+        }
+
+        if (*end != '\0')
+        {
+            *end = '\0';
+            p = end + 1;
+        }
+        else
+        {
+            p = end;
+        }
+        set_var(argv[i], start);
+    }
+
+    return 0;
+}
+
+/* funcion ejecutar el comando let: evalua cada argumento como expresion aritmetica */
+int builtin_let(int argc, char **argv)
+{
+    int64_t result = 0;
+    int i;
+
+    if (argc == 1)
+    {
+        fprintf(stderr, "let: falta la expresion\n");
+        return 1;
+    }
+
+    for (i = 1; i < argc; i++)
+    {
+        if (arith_eval(argv[i], &result) != 0)
+        {
+            return 1;
+        }
+    }
+
+    // como en (( )), el estado es 0 si el valor de la ultima expresion no es cero
+    return result == 0;
+}
+
+/* funcion ejecutar el comando exec: reemplaza el shell por el comando, sin fork */
+int builtin_exec(int argc, char **argv)
+{
+    if (argc == 1)
+    {
+        return 0;
+    }
+
+    // el comando hereda la entrada donde la ha dejado el shell y su salida pendiente
+    reader_sync(input);
+    fflush(stdout);
+    fflush(stderr);
+
+    execvp(argv[1], argv + 1);
+    fprintf(stderr, "exec: no se ha podido ejecutar %s: %s\n", argv[1], strerror(errno));
+
+    return errno == ENOENT ? 127 : 126;
+}
+
+/* funcion ejecutar el comando cache: muestra el uso de la cache de lineas, -c la vacia */
+int builtin_cache(int argc, char **argv)
+{
+    unsigned long lookups = cache_hits + cache_misses;
+
+    if (argc == 2 && strcmp(argv[1], "-c") == 0)
+    {
+        cache_clear();
+        cache_hits = 0;
+        cache_misses = 0;
+        return 0;
+    }
+    else if (argc != 1)
+    {
+        fprintf(stderr, "Uso: cache [-c]\n");
+        return 2;
+    }
+
+    printf("aciertos: %lu de %lu (%.1f%%)\n", cache_hits, lookups, lookups > 0 ? 100.0 * cache_hits / lookups : 0.0);
+    printf("entradas: %d de %d\n", cache_entries, CACHE_ENTRIES);
+    printf("memoria: %zu de %d bytes\n", cache_bytes, CACHE_BYTES);
+
+    return 0;
+}
+
+/* funcion que calcula lo que ocupa un argumento en la pila del nuevo programa: cadena y puntero */
+size_t arg_size(const char *arg)
+{
+    return strlen(arg) + 1 + sizeof(char *);
+}
+
+/* funcion que calcula el espacio que dejan ARG_MAX y el entorno actual para los argumentos de execvp() */
+size_t arg_space()
+{
+    extern char **environ;
+    long max = sysconf(_SC_ARG_MAX);
+    size_t used = ARG_HEADROOM + sizeof(char *);
+    char **e;
+
+    for (e = environ; *e != NULL; e++)
+    {
+        used += arg_size(*e);
+    }
+
+    return max > 0 && (size_t) max > used ? (size_t) max - used : 0;
+}
+
+/* funcion que espera a que acabe una de las tandas en marcha y acumula su resultado */
+void wait_batch(pid_t *pids, int *running, int *result)
+{
+    pid_t pid;
+    int status;
+    int i;
+
+    // los hijos en background que se recojan aqui no son tandas y se ignoran
+    do
+    {
+        pid = waitpid(-1, &status, 0);
+        for (i = 0; i < *running && pids[i] != pid; i++)
+        {
+        }
+    } while (pid > 0 && i == *running);
+
+    if (pid < 0)
+    {
+        *running = 0;
+        return;
+    }
+
+    trace_event(TRACE_WAIT_DONE, pid, -1, status, "xargs");
+    pids[i] = pids[--*running];
+    if (WIFEXITED(status) && WEXITSTATUS(status) == 127)
+    {
+        *result = 127;
+    }
+    else if ((!WIFEXITED(status) || WEXITSTATUS(status) != 0) && *result == 0)
+    {
+        *result = 123;
+    }
+}
+
+/* funcion que ejecuta fixed seguido de args en tandas tan grandes como permite arg_space(),
+   de como mucho max_args argumentos (0 sin limite) y con hasta parallel tandas a la vez.
+   devuelve 0 si todas acaban bien, 127 si no se encuentra el comando y 123 si alguna falla */
+int run_batches(char **fixed, int nfixed, char **args, int nargs, int max_args, int parallel)
+{
+    char **argv = (char **) malloc((nfixed + nargs + 1) * sizeof(char *));
+    pid_t *pids = (pid_t *) malloc(parallel * sizeof(pid_t));
+    size_t space = arg_space();
+    size_t size;
+    int running = 0;
+    int result = 0;
+    int first = 0;
+    int batch = 0;
+    int last;
+    int i;
+    pid_t pid;
+
+    memcpy(argv, fixed, nfixed * sizeof(char *));
+    for (i = 0; i < nfixed; i++)
+    {
+        space = arg_size(fixed[i]) < space ? space - arg_size(fixed[i]) : 0;
+    }
+
+    reader_sync(input);
+    fflush(stdout);
+    fflush(stderr);
+
+    // sin argumentos el comando se ejecuta una vez, como hace xargs
+    do
+    {
+        // cada tanda lleva al menos un argumento, si no cabe sera execvp() quien falle con E2BIG
+        last = first;
+        size = 0;
+        while (last < nargs && (last == first || size + arg_size(args[last]) <= space)
+                && (max_args == 0 || last - first < max_args))
+        {
+            size += arg_size(args[last]);
+            argv[nfixed + last - first] = args[last];
+            last++;
+        }
+        argv[nfixed + last - first] = NULL;
+
+        // si ya hay parallel tandas en marcha esperamos a que acabe una
+        if (running == parallel)
+        {
+            wait_batch(pids, &running, &result);
+        }
+        if (!run)
+        {
+            break;
+        }
+
+        pid = fork();
+        if (pid < 0)
+        {
+            fprintf(stderr, "Error en el fork() \n %s\n", strerror(errno));
+            result = 1;
+            break;
+        }
+        if (pid == 0)
+        {
+            // la entrada ya la ha consumido el shell, las tandas leen de /dev/null
+            trace_stage = batch;
+            i = open("/dev/null", O_RDONLY);
+            dup2(i, 0);
+            close(i);
+
+            execvp(argv[0], argv);
+            trace_event(TRACE_EXEC_FAIL, 0, batch, errno, argv[0]);
+            fprintf(stderr, "xargs: %s: %s\n", argv[0], strerror(errno));
+            exit(errno == ENOENT ? 127 : 126);
+        }
+
+        trace_event(TRACE_FORK, pid, batch, last - first, argv[0]);
+        pids[running++] = pid;
+        batch++;
+        first = last;
+    } while (first < nargs);
+
+    while (running > 0)
+    {
+        wait_batch(pids, &running, &result);
+    }
+    free(argv);
+    free(pids);
+
+    return result;
+}
+
+/* funcion que lee la opcion de paralelismo de xargs: 0 es una tanda por cada procesador */
+int parse_parallel(const char *text)
+{
+    char *end;
+    long n = strtol(text, &end, 10);
+
+    if (*text == '\0' || *end != '\0' || n < 0)
+    {
+        return -1;
+    }
+    if (n == 0)
+    {
+        n = sysconf(_SC_NPROCESSORS_ONLN);
+    }
+
+    return n > 0 ? (int) n : 1;
+}
+
+/* funcion ejecutar el comando xargs [-P tandas] [-n maximo] [comando [argumentos...]]: lee palabras
+   de la entrada y ejecuta el comando con ellas en el menor numero de tandas que permite ARG_MAX */
+int builtin_xargs(int argc, char **argv)
+{
+    static char *echo[] = {"echo", NULL};
+    tvec words = {NULL, 0, 0};
+    char *line;
+    char *end;
+    size_t n;
+    int max_args = 0;
+    int parallel = 1;
+    int status;
+    int i = 1;
+
+    for (; i + 1 < argc && argv[i][0] == '-'; i += 2)
+    {
+        if (strcmp(argv[i], "-P") == 0 && (parallel = parse_parallel(argv[i + 1])) > 0)
+        {
+            continue;
+        }
+        if (strcmp(argv[i], "-n") == 0 && (max_args = strtol(argv[i + 1], &end, 10)) > 0 && *end == '\0')
+        {
+            continue;
+        }
+        fprintf(stderr, "Uso: xargs [-P tandas] [-n maximo] [comando [argumentos...]]\n");
+        return 1;
+    }
+
+    while ((line = reader_getline(input, &n)) != NULL)
+    {
+        split_fields(line, &words);
+    }
+
+    if (i == argc)
+    {
+        status = run_batches(echo, 1, words.items, words.len, max_args, parallel);
+    }
+    else
+    {
+        status = run_batches(argv + i, argc - i, words.items, words.len, max_args, parallel);
+    }
+    vec_free(&words);
+
+    return status;
+}
+
+/* funcion ejecutar el comando prefetch: sin opciones precarga ya los ejecutables mas lanzados,
+   con -l muestra los lanzamientos, aciertos y dependencias de cada uno */
+int builtin_prefetch(int argc, char **argv)
+{
+    tprefetch *p;
+
+    if (argc == 1)
+    {
+        prefetch_hot();
+        return 0;
+    }
+    else if (argc != 2 || strcmp(argv[1], "-l") != 0)
+    {
+        fprintf(stderr, "Uso: prefetch [-l]\n");
+        return 2;
+    }
+
+    printf("lanzamientos aciertos dependencias  ejecutable\n");
+    for (p = launched; p != NULL; p = p->next)
+    {
+        printf("%12lu %8lu %12d %c %s\n", p->launches, p->hits, p->deps.len,
+               prefetch_is_hot(p) ? '*' : ' ', p->path);
+    }
+
+    return 0;
+}
+
+static const tbuiltin builtins[] = {
+    {"cd", builtin_cd, 0},
+    {"exit", builtin_exit, 0},
+    {"EXIT", builtin_exit, 0},
+    {"echo", builtin_echo, 1},
+    {"read", builtin_read, 1},
+    {"let", builtin_let, 0},
+    {"exec", builtin_exec, 0},
+    {"cache", builtin_cache, 0},
+    {"xargs", builtin_xargs, 0},
+    {"prefetch", builtin_prefetch, 0},
+    {"true", builtin_true, 1},
+    {":", builtin_true, 1},
+    {"false", builtin_false, 1},
+    {NULL, NULL, 0}
+};
+
+/* funcion que busca el builtin con el nombre del comando */
+const tbuiltin *find_builtin(const char *name)
+{
+    const tbuiltin *b;
+
+    for (b = builtins; b->name != NULL; b++)
+    {
+        if (strcmp(b->name, name) == 0)
+        {
+            return b;
+        }
+    }
+
+    return NULL;
+}
+
+/* funcion que abre el fichero de una redireccion, devuelve -1 si no es posible */
+int open_redirect(char *file, char mode)
+{
+    int d = -1;
+    mode_t userMode = S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH;
+
+    // char 'r' para indicar la lectura (read)
+    if (mode == 'r')
+    {
+        d = open(file, O_RDONLY); // abrimos para lectura sólo
+    }
+
+    // char 'w' para indicar la escritura (write)
+    if (mode == 'w')
+    {
+        d = open(file, O_WRONLY | O_CREAT | O_TRUNC, userMode); // abrimos para escritura sólo
+    }
+
+    // si el descriptor no fue modificado o no se puedo abrir, entonces existe un error
+    if (d == -1)
+    {
+        fprintf(stderr, "No ha sido posible abrir el archivo %s \n. Error: %s\n", file, strerror(errno));
+    }
+
+    return d;
+}
+
+/* funcion para manejar las redirecciones */
+int handle_redirect(char *file, char mode)
+{
+    int d = open_redirect(file, mode);
+
+    if (d == -1)
+    {
+        exit(-1);
+    }
+
+    return d;
+}
+
+/* funcion para redirigir a entrada estandar */
+void redirect_to_stdin(tline *line)
+{
+    int d;
+
+    if (line->redirect_input != NULL)
+    {
+        d = handle_redirect(line->redirect_input, 'r');
+        dup2(d, 0);
+        trace_event(TRACE_REDIRECT, 0, trace_stage, 0, line->redirect_input);
+    }
+}
+
+/* funcion para redirigir a salida estandar */
+void redirect_to_stdout(tline *line)
+{
+    int d;
+
+    if (line->redirect_output != NULL)
+    {
+        d = handle_redirect(line->redirect_output, 'w');
+        dup2(d, 1);
+        trace_event(TRACE_REDIRECT, 0, trace_stage, 1, line->redirect_output);
+    }
+}
+
+/* funcion para redirigir a la salida de error */
+void redirect_to_stderr(tline *line)
+{
+    int d;
+
+    if (line->redirect_error != NULL)
+    {
+        d = handle_redirect(line->redirect_error, 'w');
+        dup2(d, 2);
+        trace_event(TRACE_REDIRECT, 0, trace_stage, 2, line->redirect_error);
+    }
+}
+
+/* funcion que deshace las redirecciones hechas con redirect_in_shell() */
+void restore_in_shell(int saved[3])
+{
+    int i;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < 3; i++)
+    {
+        if (saved[i] != -1)
+        {
+            dup2(saved[i], i);
+            close(saved[i]);
+            saved[i] = -1;
+
+            if (i == 0)
+            {
+                pop_input();
+            }
+        }
+    }
+}
+
+/* funcion que redirige la entrada, salida y error del propio shell guardando los
+   descriptores originales, para builtins y bloques de control redirigidos */
+int redirect_in_shell(char *in, char *out, char *err, int saved[3])
+{
+    char *files[3] = {in, out, err};
+    char modes[3] = {'r', 'w', 'w'};
+    int d;
+    int i;
+
+    fflush(stdout);
+    fflush(stderr);
+
+    for (i = 0; i < 3; i++)
+    {
+        saved[i] = -1;
+    }
+
+    for (i = 0; i < 3; i++)
+    {
+        if (files[i] != NULL)
+        {
+            d = open_redirect(files[i], modes[i]);
+            if (d == -1)
+            {
+                restore_in_shell(saved);
+                return -1;
+            }
+
+            // el descriptor guardado no lo deben heredar los hijos
+            saved[i] = fcntl(i, F_DUPFD_CLOEXEC, 10);
+            dup2(d, i);
+            close(d);
+
+            // la entrada nueva necesita su propio lector
+            if (i == 0)
+            {
+                push_input();
+            }
+        }
+    }
+
+    return 0;
+}
+
+/* funcion que ejecuta un builtin en el hijo de una tuberia y termina el proceso */
+void run_builtin_child(const tbuiltin *b, tcommand *command, int stdin_changed)
+{
+    int status;
+
+    // si la entrada viene de una tuberia o un fichero el lector heredado ya no sirve
+    if (stdin_changed)
+    {
+        input = reader_new(0);
+    }
+
+    status = b->fn(command->argc, command->argv);
+    fflush(stdout);
+    exit(status);
+}
+
+/* funcion que ejecuta en el hijo la etapa i de una tuberia, ya con sus redirecciones, y no vuelve */
+void exec_stage(tline *line, int i)
+{
+    const tbuiltin *b;
+    int error;
+
+    // los builtins se ejecutan en el propio hijo sin hacer exec
+    b = find_builtin(line->commands[i].argv[0]);
+    if (b != NULL)
+    {
+        run_builtin_child(b, &line->commands[i], i > 0 || line->redirect_input != NULL);
+    }
+
+    // una vez hecho las redirecciones necesarias, ejecutamos. el comando se busca ahora, con el
+    // directorio y el PATH actuales; el filename resuelto al analizar la linea puede estar anticuado
+    execvp(line->commands[i].argv[0], line->commands[i].argv);
+    error = errno;
+    trace_event(TRACE_EXEC_FAIL, 0, i, error, line->commands[i].argv[0]);
+    if (error == ENOENT)
+    {
+        printf("El comando introducido %s no se ha encontrado.\n", line->commands[i].argv[0]);
+    }
+    else
+    {
+        printf("Se ha producido un error en la ejecucion del comando %s.\n", line->commands[i].argv[0]);
+    }
+
+    exit(1); // error si consigue llegar aqui
+}
+
+/* funcion que ejecuta una etapa de la tuberia como hilo del shell */
+void *run_stage(void *arg)
+{
+    tstage *stage = (tstage *) arg;
+    sigset_t pipe_signal;
+
+    // escribir en una tuberia cerrada da EPIPE en este hilo en vez de matar al shell
+    sigemptyset(&pipe_signal);
+    sigaddset(&pipe_signal, SIGPIPE);
+    pthread_sigmask(SIG_BLOCK, &pipe_signal, NULL);
+
+    current_stage = stage;
+    input = stage->reader;
+    stage->status = stage->builtin->fn(stage->command->argc, stage->command->argv);
+
+    // como al terminar un proceso: el siguiente ve el final y el anterior deja de escribir
+    if (stage->out != NULL)
+    {
+        ring_close(stage->out);
+    }
+    if (stage->in != NULL)
+    {
+        ring_abandon(stage->in);
+    }
+    if (stage->out_fd > 2)
+    {
+        close(stage->out_fd);
+        stage->out_fd = -1;
+    }
+    if (stage->in_fd > 2)
+    {
+        close(stage->in_fd);
+        stage->in_fd = -1;
+    }
+
+    return NULL;
+}
+
+/* funcion que devuelve el builtin de la etapa i si se puede ejecutar como hilo. read solo en la
+   ultima etapa: asigna la variable en el propio shell y ninguna otra etapa en hilo las toca.
+   la ultima etapa con >& es un proceso, un hilo no puede tener su propia salida de error */
+const tbuiltin *stage_builtin(tline *line, int i)
+{
+    const tbuiltin *b = find_builtin(line->commands[i].argv[0]);
+    int last = i == line->ncommands - 1;
+
+    if (b == NULL || !b->threads || (b->fn == builtin_read && !last) || (last && line->redirect_error != NULL))
+    {
+        return NULL;
+    }
+
+    return b;
+}
+
+/* funcion que cierra los descriptores de las etapas que no son la entrada ni la salida estandar */
+void close_stage_fds(tstage *stages, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        if (stages[i].in_fd > 2)
+        {
+            close(stages[i].in_fd);
+        }
+        if (stages[i].out_fd > 2)
+        {
+            close(stages[i].out_fd);
+        }
+    }
+}
+
+/* funcion que ejecuta una tuberia con sus builtins como hilos del shell: entre dos hilos los datos
+   pasan por un buffer circular en memoria y solo hay tuberias del kernel junto a los procesos.
+   devuelve el estado de la ultima etapa como lo da waitpid() */
+int execute_fused(tline *line)
+{
+    int n = line->ncommands;
+    tstage *stages = (tstage *) calloc(n, sizeof(tstage));
+    pid_t *pids = (pid_t *) malloc(n * sizeof(pid_t));
+    tstage *st;
+    int fds[2];
+    int failed = 0;
+    int status = 0;
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        stages[i].builtin = stage_builtin(line, i);
+        stages[i].command = &line->commands[i];
+        stages[i].index = i;
+        stages[i].in_fd = -1;
+        stages[i].out_fd = -1;
+    }
+
+    // conexiones entre etapas; las tuberias no las heredan los procesos que no las usan
+    for (i = 0; i + 1 < n; i++)
+    {
+        if (stages[i].builtin != NULL && stages[i + 1].builtin != NULL)
+        {
+            stages[i].out = (tring *) calloc(1, sizeof(tring));
+            stages[i + 1].in = stages[i].out;
+        }
+        else
+        {
+            pipe2(fds, O_CLOEXEC);
+            stages[i].out_fd = fds[1];
+            stages[i + 1].in_fd = fds[0];
+        }
+    }
+
+    // las redirecciones de los hilos se abren en el shell, las de los procesos en el hijo
+    if (stages[0].builtin != NULL && line->redirect_input != NULL)
+    {
+        stages[0].in_fd = open_redirect(line->redirect_input, 'r');
+        failed = stages[0].in_fd == -1;
+    }
+    if (stages[n - 1].builtin != NULL)
+    {
+        stages[n - 1].out_fd = line->redirect_output != NULL ? open_redirect(line->redirect_output, 'w') : 1;
+        failed |= stages[n - 1].out_fd == -1;
+    }
+
+    // primero los fork(), para no duplicar el proceso con hilos en marcha
+    for (i = 0; i < n && !failed; i++)
+    {
+        st = &stages[i];
+        if (st->builtin != NULL)
+        {
+            continue;
+        }
+
+        pids[i] = fork();
+        if (pids[i] < 0)
+        {
+            fprintf(stderr, "Error en el fork() \n %s\n", strerror(errno));
+            exit(-1);
+        }
+        if (pids[i] == 0)
+        {
+            trace_stage = i;
+            if (i == 0)
+            {
+                redirect_to_stdin(line);
+            }
+            else
+            {
+                dup2(st->in_fd, 0);
+            }
+            if (i == n - 1)
+            {
+                redirect_to_stdout(line);
+                redirect_to_stderr(line);
+            }
+            else
+            {
+                dup2(st->out_fd, 1);
+            }
+
+            // un builtin que no hace exec no debe quedarse con los extremos de otras etapas
+            close_stage_fds(stages, n);
+            exec_stage(line, i);
+        }
+
+        trace_event(TRACE_FORK, pids[i], i, n, st->command->argv[0]);
+        prefetch_count(st->command->filename);
+    }
+
+    for (i = 0; i < n && !failed; i++)
+    {
+        st = &stages[i];
+        if (st->builtin == NULL)
+        {
+            // los extremos de los procesos ya los tienen ellos
+            if (st->in_fd > 2)
+            {
+                close(st->in_fd);
+            }
+            if (st->out_fd > 2)
+            {
+                close(st->out_fd);
+            }
+            st->in_fd = -1;
+            st->out_fd = -1;
+            continue;
+        }
+
+        // sin buffer ni tuberia, la primera etapa lee del lector del shell, que espera sin usarlo
+        if (st->in != NULL)
+        {
+            st->reader = reader_new(-1);
+            st->reader->ring = st->in;
+        }
+        else
+        {
+            st->reader = st->in_fd != -1 ? reader_new(st->in_fd) : input;
+        }
+        trace_event(TRACE_FORK, 0, i, n, st->command->argv[0]);
+        pthread_create(&st->thread, NULL, run_stage, st);
+    }
+
+    for (i = 0; i < n && !failed; i++)
+    {
+        st = &stages[i];
+        if (st->builtin != NULL)
+        {
+            pthread_join(st->thread, NULL);
+            if (st->reader != input)
+            {
+                reader_free(st->reader);
+            }
+            trace_event(TRACE_WAIT_DONE, 0, i, W_EXITCODE(st->status, 0), st->command->argv[0]);
+        }
+    }
+    for (i = 0; i < n && !failed; i++)
+    {
+        if (stages[i].builtin == NULL)
+        {
+            waitpid(pids[i], &status, 0);
+            trace_event(TRACE_WAIT_DONE, pids[i], i, status, stages[i].command->argv[0]);
+        }
+    }
+
+    // el estado es el de la ultima etapa, o un fallo si no se ha podido abrir una redireccion
+    if (failed || stages[n - 1].builtin != NULL)
+    {
+        status = W_EXITCODE(failed ? 1 : stages[n - 1].status, 0);
+    }
+
+    close_stage_fds(stages, n);
+    for (i = 0; i < n; i++)
+    {
+        free(stages[i].out);
+    }
+    free(stages);
+    free(pids);
+
+    return status;
+}
+
+/* funcion que indica si alguna etapa de la tuberia se puede ejecutar como hilo del shell */
+int has_thread_stage(tline *line)
+{
+    int i;
+
+    for (i = 0; i < line->ncommands; i++)
+    {
+        if (stage_builtin(line, i) != NULL)
+        {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+/* funcion que pasa el estado de waitpid() al de $?, avisando si el comando ha fallado */
+int command_status(int status)
+{
+    // para saber si el hijo hizo un exit() o no
+    if (WIFEXITED(status) != 0)
+    {
+        // si el exit() que hizo el hijo funciono o no, las condiciones fallan en silencio
+        if (WEXITSTATUS(status) != 0 && !in_condition && !subst_depth)
+        {
+            printf("¡El comando no se ha ejecutado!\n");
+        }
+
+        return WEXITSTATUS(status);
+    }
+
+    return 128 + WTERMSIG(status);
+}
+
+/* funcion que convierte una duracion (1.5, 30s, 200ms, 2m, 1h) a nanosegundos; devuelve -1 si no es valida */
+int parse_duration(const char *text, int64_t *ns)
+{
+    char *end;
+    double value = strtod(text, &end);
+    double unit;
+
+    if (end == text || value < 0)
+    {
+        return -1;
+    }
+
+    if (*end == '\0' || strcmp(end, "s") == 0)
+    {
+        unit = 1e9;
+    }
+    else if (strcmp(end, "ms") == 0)
+    {
+        unit = 1e6;
+    }
+    else if (strcmp(end, "m") == 0)
+    {
+        unit = 60e9;
+    }
+    else if (strcmp(end, "h") == 0)
+    {
+        unit = 3600e9;
+    }
+    else
+    {
+        return -1;
+    }
+
+    *ns = (int64_t) (value * unit);
+
+    return 0;
+}
+
+/* funcion que programa el timerfd para que venza dentro de ns nanosegundos */
+void arm_timer(int fd, int64_t ns)
+{
+    struct itimerspec its;
+
+    memset(&its, 0, sizeof(its));
+    its.it_value.tv_sec = ns / 1000000000;
+    its.it_value.tv_nsec = ns % 1000000000;
+    timerfd_settime(fd, 0, &its, NULL);
+}
+
+/* funcion que espera a todas las etapas de la tuberia con un tiempo limite: poll() sobre un pidfd
+   por etapa y un timerfd, sin procesos vigilantes. al vencer el limite avisa de las etapas que
+   siguen en marcha y envia SIGTERM al grupo de procesos de la tuberia. la gracia sigue hasta que
+   no queda nadie en el grupo, tambien los procesos que hayan lanzado las etapas, y si se acaba
+   antes envia SIGKILL. devuelve el estado de waitpid() del ultimo comando */
+int wait_with_deadline(tline *line, pid_t *pids, const ttimeout *timeout, int *timed_out)
+{
+    int n = line->ncommands;
+    struct pollfd *fds = (struct pollfd *) malloc((n + 1) * sizeof(struct pollfd));
+    char *reaped = (char *) calloc(n, 1);
+    uint64_t expirations;
+    int running = n;
+    int status = 0;
+    int stage_status;
+    int watching;
+    int killed = 0;
+    int i;
+
+    *timed_out = 0;
+    fds[n].fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+    fds[n].events = POLLIN;
+    watching = fds[n].fd != -1;
+    for (i = 0; i < n; i++)
+    {
+        fds[i].fd = syscall(SYS_pidfd_open, pids[i], 0);
+        fds[i].events = POLLIN;
+        watching &= fds[i].fd != -1;
+    }
+
+    if (!watching)
+    {
+        fprintf(stderr, "No es posible vigilar el tiempo limite: %s\n", strerror(errno));
+    }
+    else
+    {
+        arm_timer(fds[n].fd, timeout->limit);
+
+        // tras el SIGTERM los procesos del grupo que no son hijos del shell solo se ven con kill()
+        while (running > 0 || (*timed_out && !killed && kill(-pids[0], 0) == 0))
+        {
+            if (poll(fds, n + 1, running > 0 ? -1 : TIMEOUT_POLL) < 0)
+            {
+                if (errno == EINTR)
+                {
+                    continue;
+                }
+                break;
+            }
+
+            // el pidfd se puede leer cuando la etapa ha terminado; poll() ignora los ya cerrados
+            for (i = 0; i < n; i++)
+            {
+                if (!reaped[i] && fds[i].revents != 0)
+                {
+                    waitpid(pids[i], &stage_status, 0);
+                    if (i == n - 1)
+                    {
+                        status = stage_status;
+                    }
+                    reaped[i] = 1;
+                    running--;
+                    close(fds[i].fd);
+                    fds[i].fd = -1;
+                }
+            }
+
+            if (fds[n].revents == 0)
+            {
+                continue;
+            }
+
+            read(fds[n].fd, &expirations, sizeof(expirations));
+            if (!*timed_out)
+            {
+                for (i = 0; i < n; i++)
+                {
+                    if (!reaped[i])
+                    {
+                        fprintf(stderr, "Tiempo limite de %s superado en la etapa %d (%s)\n",
+                                timeout->text, i, line->commands[i].argv[0]);
+                    }
+                }
+                kill(-pids[0], SIGTERM);
+                *timed_out = 1;
+                arm_timer(fds[n].fd, timeout->grace > 0 ? timeout->grace : 1);
+            }
+            else
+            {
+                kill(-pids[0], SIGKILL);
+                killed = 1;
+            }
+        }
+    }
+
+    // sin vigilancia, o si ha fallado poll(), se espera a las etapas sin limite
+    for (i = 0; i < n; i++)
+    {
+        if (fds[i].fd != -1)
+        {
+            close(fds[i].fd);
+        }
+        if (!reaped[i])
+        {
+            waitpid(pids[i], &stage_status, 0);
+            if (i == n - 1)
+            {
+                status = stage_status;
+            }
+        }
+    }
+    if (fds[n].fd != -1)
+    {
+        close(fds[n].fd);
+    }
+    free(fds);
+    free(reaped);
+
+    return status;
+}
+
+/* funcion que en un hijo de una tuberia con tiempo limite, ya en su grupo, toma el terminal si lo
+   tenia el shell, sin esperar a que se lo de el padre, y vuelve a permitir SIGTTOU */
+void take_terminal(int terminal, const sigset_t *ttou)
+{
+    if (terminal)
+    {
+        tcsetpgrp(0, getpgrp());
+    }
+    sigprocmask(SIG_UNBLOCK, ttou, NULL);
+}
+
+/* funcion que devuelve el tiempo limite por defecto de la variable MSH_DEADLINE, o NULL si no hay */
+const ttimeout *default_timeout()
+{
+    static ttimeout timeout;
+    char *text = get_var("MSH_DEADLINE");
+
+    if (text == NULL || *text == '\0' || parse_duration(text, &timeout.limit) != 0 || timeout.limit == 0)
+    {
+        return NULL;
+    }
+    timeout.grace = TIMEOUT_GRACE;
+    timeout.text = text;
+
+    return &timeout;
+}
+
+/* funcion principal para ejecutar 1 o n comandos, devuelve el estado de salida;
+   con timeout la tuberia va en su propio grupo de procesos y se espera con tiempo limite */
+int execute_command(tline *line, const ttimeout *timeout)
+{
+    // variables
+    pid_t pid = -1;
+    pid_t *pids;
+    int status;
+    int timed_out = 0;
+    int terminal = 0;
+    sigset_t ttou;
+    const tbuiltin *b;
+    tline view;
+    int error;
+
+    // los hijos heredan la entrada donde la ha dejado el shell y no duplican su salida pendiente
+    reader_sync(input);
+    fflush(stdout);
+    fflush(stderr);
+
+    if (line->ncommands == 0)
+    {
+        return 0;
+    }
+
+    // las tuberias con builtins los ejecutan en hilos; con timeout hacen falta procesos para cortarlos
+    if (line->ncommands > 1 && timeout == NULL && !line->background && has_thread_stage(line))
+    {
+        return command_status(execute_fused(line));
+    }
+
+    // en background el tiempo limite lo vigila un hijo del shell que espera a la tuberia; en su
+    // propio grupo no toma el terminal
+    if (timeout != NULL && line->background)
+    {
+        pid = fork();
+        if (pid < 0)
+        {
+            fprintf(stderr, "Error en el fork() \n %s\n", strerror(errno));
+            exit(-1);
+        }
+        if (pid == 0)
+        {
+            setpgid(0, 0);
+            view = *line;
+            view.background = 0;
+            exit(execute_command(&view, timeout));
+        }
+
+        trace_event(TRACE_FORK, pid, 0, line->ncommands, "timeout");
+        printf(" [%d] \n", pid);
+        return 0;
+    }
+
+    // con tiempo limite la tuberia va en su propio grupo, que pasa a primer plano en el terminal
+    // para que pueda leer de el. SIGTTOU se bloquea antes del fork() para que los hijos tambien lo tomen
+    if (timeout != NULL)
+    {
+        sigemptyset(&ttou);
+        sigaddset(&ttou, SIGTTOU);
+        sigprocmask(SIG_BLOCK, &ttou, NULL);
+        terminal = isatty(0) && tcgetpgrp(0) == getpgrp();
+    }
+    pids = (pid_t *) malloc(line->ncommands * sizeof(pid_t));
+
+    // control del numero de comandos introducidos
+    if (line->ncommands == 1)
+    {
+        // hacemos el fork()
+        pid = fork();
+
+        // error
+        if (pid < 0)
+        {
+            fprintf(stderr, "Error en el fork() \n %s\n", strerror(errno));
+            exit(-1);
+        }
+
+        // proceso hijo
+        if (pid == 0)
+        {
+            trace_stage = 0;
+            if (timeout != NULL)
+            {
+                setpgid(0, 0);
+                take_terminal(terminal, &ttou);
+            }
+
+            // redirecciones en el primer comando por que sólo hay un comando
+            redirect_to_stdin(line);
+            redirect_to_stdout(line);
+            redirect_to_stderr(line);
+
+            // con timeout un builtin tambien se ejecuta en el hijo para poder cortarlo
+            b = find_builtin(line->commands[0].argv[0]);
+            if (b != NULL)
+            {
+                run_builtin_child(b, &line->commands[0], line->redirect_input != NULL);
+            }
+
+            // el hijo ejecuta el comando con sus opciones, buscandolo con el directorio y el PATH actuales
+            execvp(line->commands[0].argv[0], line->commands[0].argv);
+            error = errno;
+            trace_event(TRACE_EXEC_FAIL, 0, 0, error, line->commands[0].argv[0]);
+            if (error == ENOENT)
+            {
+                fprintf(stderr, "El comando %s no se encuentra.", line->commands[0].argv[0]);
+            }
+            else
+            {
+                printf("Se ha producido un error en la ejecucion del comando.\n");
+            }
+            exit(1); // error si consigue llegar hasta aqui
+        }
+
+        trace_event(TRACE_FORK, pid, 0, line->ncommands, line->commands[0].argv[0]);
+        prefetch_count(line->commands[0].filename);
+        pids[0] = pid;
+    }
+    else if (line->ncommands > 1)
+    {
+        // variables
+        int i;
+        int size_array = line -> ncommands - 1;
+        int size_commands = line -> ncommands;
+        int **p = (int **) malloc (size_array * sizeof(int *));
+
+        // una vez reservado el espacio del array de arrays de integer,
+        // en cada posicion reservamos un array de 2 posiciones
+        for (i = 0; i < size_array; i++)
+        {
+            p[i] = (int *)malloc(2 * sizeof(int));
+        }
+
+        // por cada comando, duplicamos el proceso y creamos un pipe
+        for (i = 0; i < size_commands; i++)
+        {
+            // creamos un pipe excepto en el último comando
+            if (i != size_array)
+            {
+                pipe(p[i]);
+            }
+
+            // hacemos el fork()
+            pid = fork();
+
+            // error
+            if (pid < 0)
+            {
+                fprintf(stderr, "Error en el fork() \n %s\n", strerror(errno));
+                exit(-1);
+            }
+
+            // proceso hijo
+            if (pid == 0)
+            {
+                trace_stage = i;
+                if (timeout != NULL)
+                {
+                    setpgid(0, i == 0 ? 0 : pids[0]);
+                    take_terminal(terminal, &ttou);
+                }
+
+                // redirección primer comando
+                if (i == 0)
+                {
+                    // cerramos la parte de lectura no utilizada
+                    close(p[i][0]);
+
+                    // el primer hijo controla la redirección del input
+                    redirect_to_stdin(line);
+
+                    // y escribimos
+                    dup2(p[i][1], 1);
+                }
+                else if (i == size_array)
+                {
+                    // cerramos la parte de escritura no utilizada
+                    close(p[i-1][1]);
+
+                    // el ultimo hijo controla la redirección del output y error
+                    redirect_to_stdout(line);
+                    redirect_to_stderr(line);
+
+                    // y leeemos
+                    dup2(p[i-1][0], 0);
+                }
+                else
+                {
+                    // cerramos de manera correcta
+                    close(p[i-1][1]);
+                    close(p[i][0]);
+
+                    // y sino es ni el primero ni el ultimo,
+                    // conectamos las tuberias de la manera correcta
+                    dup2(p[i-1][0], 0);
+                    dup2(p[i][1], 1);
+                }
+
+                // cerrar los pipes previos
+                for (int j = 0; j < i; j++)
+                {
+                    close(p[j][0]);
+                    close(p[j][1]);
+                }
+
+                exec_stage(line, i);
+            }
+
+            trace_event(TRACE_FORK, pid, i, line->ncommands, line->commands[i].argv[0]);
+            prefetch_count(line->commands[i].filename);
+            pids[i] = pid;
+            if (timeout != NULL)
+            {
+                setpgid(pid, pids[0]);
+            }
+        }
+
+        // cerramos pipes y liberamos memoria
+        for (i = 0; i < size_array; i++)
+        {
+            // si no se cierran los descriptores de los pipes anteriores
+            // el comando se cree que tiene todavía cosas por leer
+            close(p[i][0]);
+            close(p[i][1]);
+
+            free(p[i]);
+        }
+        free(p);
+    }
+
+    // si no ejecuta en background, esperamos a la finalización normal del proceso
+    if (!line->background)
+    {
+        if (timeout != NULL)
+        {
+            setpgid(pids[0], pids[0]);
+            if (terminal)
+            {
+                tcsetpgrp(0, pids[0]);
+            }
+
+            status = wait_with_deadline(line, pids, timeout, &timed_out);
+
+            if (terminal)
+            {
+                tcsetpgrp(0, getpgrp());
+            }
+            sigprocmask(SIG_UNBLOCK, &ttou, NULL);
+        }
+        else
+        {
+            waitpid(pid, &status, 0);
+        }
+        free(pids);
+        trace_event(TRACE_WAIT_DONE, pid, line->ncommands - 1, status, line->commands[line->ncommands - 1].argv[0]);
+
+        if (timed_out)
+        {
+            return TIMEOUT_STATUS;
+        }
+
+        return command_status(status);
+    }
+    else
+    {
+        free(pids);
+        printf(" [%d] \n", pid); // si la linea tiene background, imprime el pid del proceso sin esperar
+    }
+
+    return 0;
+}
+
+/* funcion que ejecuta un builtin en el propio shell aplicando sus redirecciones */
+int run_builtin(tline *line, const tbuiltin *b)
+{
+    int saved[3];
+    int status;
+
+    if (redirect_in_shell(line->redirect_input, line->redirect_output, line->redirect_error, saved) != 0)
+    {
+        return 1;
+    }
+
+    status = b->fn(line->commands[0].argc, line->commands[0].argv);
+    restore_in_shell(saved);
+
+    return status;
+}
+
+/* funcion que ejecuta timeout [-k gracia] duracion comando...: la tuberia entera se ejecuta
+   con ese tiempo limite, sin lanzar ningun proceso vigilante */
+int execute_timeout(tline *line)
+{
+    tcommand *command = &line->commands[0];
+    ttimeout timeout = {0, TIMEOUT_GRACE, NULL};
+    tcommand *commands;
+    tline view;
+    int i = 1;
+    int status;
+
+    if (command->argc > 2 && strcmp(command->argv[1], "-k") == 0)
+    {
+        if (parse_duration(command->argv[2], &timeout.grace) != 0)
+        {
+            fprintf(stderr, "timeout: duracion no valida: %s\n", command->argv[2]);
+            return 125;
+        }
+        i = 3;
+    }
+    if (i + 1 >= command->argc || parse_duration(command->argv[i], &timeout.limit) != 0)
+    {
+        fprintf(stderr, "Uso: timeout [-k gracia] duracion comando [argumentos...]\n");
+        return 125;
+    }
+    timeout.text = command->argv[i];
+
+    // vista de la linea sin el prefijo; el comando se busca en el PATH al hacer execvp()
+    commands = (tcommand *) malloc(line->ncommands * sizeof(tcommand));
+    memcpy(commands, line->commands, line->ncommands * sizeof(tcommand));
+    commands[0].argc -= i + 1;
+    commands[0].argv += i + 1;
+    commands[0].filename = commands[0].argv[0];
+    view = *line;
+    view.commands = commands;
+
+    // una duracion 0 desactiva el limite
+    status = execute_command(&view, timeout.limit > 0 ? &timeout : NULL);
+    free(commands);
+
+    return status;
+}
+
+/* funcion que indica si la linea es una copia pura: cat solo con ficheros y redirecciones, sin opciones.
+   sin ficheros ni redireccion de entrada no lo es, leeria del terminal */
+int is_copy_line(tline *line)
+{
+    tcommand *command = &line->commands[0];
+    int i;
+
+    if (line->ncommands != 1 || line->background || line->redirect_error != NULL
+            || strcmp(command->argv[0], "cat") != 0 || (command->argc == 1 && line->redirect_input == NULL))
+    {
+        return 0;
+    }
+
+    for (i = 1; i < command->argc; i++)
+    {
+        if (command->argv[i][0] == '-')
+        {
+            return 0;
+        }
+    }
+
+    return default_timeout() == NULL;
+}
+
+/* funcion que copia lo que queda de in en out sin pasar por el shell: copy_file_range(), que con
+   reflink solo comparte bloques, si no sendfile() o splice() si hay una tuberia, y como ultimo
+   recurso o si la entrada no es un fichero regular, read/write. cada uno sigue donde lo dejo el anterior porque usan la posicion de los descriptores */
+int copy_fd(int in, int out)
+{
+    struct stat in_st;
+    struct stat out_st;
+    char *buf = NULL;
+    ssize_t n = 0;
+    int method = 0;
+
+    fstat(out, &out_st);
+
+    // como coreutils, el kernel solo copia ficheros regulares con tamano: en /proc o sysfs el
+    // tamano es 0 y copy_file_range() entre sistemas de ficheros devuelve 0 en kernels 5.3-5.18,
+    // que parece el final del fichero
+    if (fstat(in, &in_st) != 0 || !S_ISREG(in_st.st_mode) || in_st.st_size == 0)
+    {
+        method = 3;
+    }
+
+    while (1)
+    {
+        if (method == 0)
+        {
+            n = copy_file_range(in, NULL, out, NULL, COPY_CHUNK, 0);
+        }
+        else if (method == 1)
+        {
+            n = sendfile(out, in, NULL, COPY_CHUNK);
+        }
+        else if (method == 2)
+        {
+            n = splice(in, NULL, out, NULL, COPY_CHUNK, SPLICE_F_MOVE);
+        }
+        else
+        {
+            if (buf == NULL)
+            {
+                buf = (char *) malloc(COPY_BUFFER);
+            }
+            n = read(in, buf, COPY_BUFFER);
+            if (n > 0 && write_all(out, buf, n) != 0)
+            {
+                n = -1;
+            }
+        }
+
+        if (n == 0)
+        {
+            break;
+        }
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && method < 3 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+                || errno == EOPNOTSUPP || errno == EBADF || errno == ESPIPE))
+        {
+            // el metodo no vale para estos descriptores, splice solo si alguno es una tuberia
+            method++;
+            if (method == 2 && !S_ISFIFO(in_st.st_mode) && !S_ISFIFO(out_st.st_mode))
+            {
+                method++;
+            }
+            continue;
+        }
+        if (n < 0)
+        {
+            break;
+        }
+    }
+
+    free(buf);
+
+    return n < 0 ? -1 : 0;
+}
+
+/* funcion que ejecuta en el propio shell una copia pura con cat, sin fork() ni exec() */
+int execute_copy(tline *line)
+{
+    tcommand *command = &line->commands[0];
+    struct sigaction ignore;
+    struct sigaction old_pipe;
+    int out = 1;
+    int in;
+    int status = 0;
+    int broken = 0;
+    int i;
+
+    // con la salida cerrada la copia da EPIPE en vez de matar al shell con SIGPIPE
+    memset(&ignore, 0, sizeof(ignore));
+    ignore.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE, &ignore, &old_pipe);
+
+    // lo que el lector del shell haya leido de mas vuelve a la entrada, como para un hijo
+    reader_sync(input);
+    fflush(stdout);
+
+    if (line->redirect_output != NULL && (out = open_redirect(line->redirect_output, 'w')) == -1)
+    {
+        sigaction(SIGPIPE, &old_pipe, NULL);
+        return command_status(W_EXITCODE(1, 0));
+    }
+
+    // sin ficheros cat copia su entrada, que aqui es la redireccion
+    for (i = command->argc == 1 ? 0 : 1; i < command->argc; i++)
+    {
+        if (command->argc == 1)
+        {
+            in = open_redirect(line->redirect_input, 'r');
+            if (in == -1)
+            {
+                status = 1;
+                break;
+            }
+        }
+        else if ((in = open(command->argv[i], O_RDONLY | O_CLOEXEC)) == -1)
+        {
+            fprintf(stderr, "cat: %s: %s\n", command->argv[i], strerror(errno));
+            status = 1;
+            continue;
+        }
+
+        if (copy_fd(in, out) != 0)
+        {
+            // como cat al recibir SIGPIPE: deja de copiar sin mensaje
+            if (errno == EPIPE)
+            {
+                broken = 1;
+                close(in);
+                break;
+            }
+            fprintf(stderr, "cat: %s: %s\n", command->argc == 1 ? line->redirect_input : command->argv[i], strerror(errno));
+            status = 1;
+        }
+        close(in);
+    }
+
+    if (out != 1)
+    {
+        close(out);
+    }
+    sigaction(SIGPIPE, &old_pipe, NULL);
+
+    // el estado es el de un cat que hubiera terminado por SIGPIPE
+    return command_status(broken ? W_EXITCODE(0, SIGPIPE) : W_EXITCODE(status, 0));
+}
+
+/* funcion que indica si un comando supera el espacio de argumentos y se debe ejecutar por tandas.
+   es opcional: MSH_XARGS indica cuantas tandas a la vez (0 una por procesador) */
+int needs_batches(tline *line, int *parallel)
+{
+    char *value = get_var("MSH_XARGS");
+    tcommand *command = &line->commands[0];
+    size_t size = 0;
+    int i;
+
+    if (value == NULL || line->ncommands != 1 || line->background
+            || (*parallel = parse_parallel(value)) <= 0)
+    {
+        return 0;
+    }
+
+    for (i = 0; i < command->argc; i++)
+    {
+        size += arg_size(command->argv[i]);
+    }
+
+    return size > arg_space();
+}
+
+/* funcion que ejecuta por tandas un comando con demasiados argumentos: las opciones iniciales
+   (hasta '--' incluido) se repiten en cada tanda y el resto se reparte entre ellas */
+int execute_batches(tline *line, int parallel)
+{
+    tcommand *command = &line->commands[0];
+    int saved[3];
+    int nfixed = 1;
+    int status;
+
+    while (nfixed < command->argc && command->argv[nfixed][0] == '-')
+    {
+        if (strcmp(command->argv[nfixed++], "--") == 0)
+        {
+            break;
+        }
+    }
+
+    // todas las tandas comparten las redirecciones, asi que se hacen en el propio shell
+    if (redirect_in_shell(line->redirect_input, line->redirect_output, line->redirect_error, saved) != 0)
+    {
+        return 1;
+    }
+    status = run_batches(command->argv, nfixed, command->argv + nfixed, command->argc - nfixed, 0, parallel);
+    restore_in_shell(saved);
+
+    return status;
+}
+
+/* funcion que ejecuta un comando simple: asignacion, builtin o comandos externos */
+int execute_simple(tnode *node)
+{
+    tline *line = node->line;
+    tcommand *command;
+    const tbuiltin *b;
+    char *eq;
+    char *name;
+    int status;
+    int parallel;
+
+    // la linea ya esta tokenizada, solo expandimos las variables si las tiene
+    if (node->expand)
+    {
+        expand_failed = 0;
+        subst_ran = 0;
+        line = expand_line(node->line, &node->subst);
+    }
+    command = &line->commands[0];
+
+    if (expand_failed)
+    {
+        // no se ejecuta un comando con una expansion erronea
+        expand_failed = 0;
+        status = 1;
+    }
+    else if (command->argc == 0)
+    {
+        // la linea se ha quedado vacia tras expandirla, queda el estado de la sustitucion
+        status = subst_ran ? last_status : 0;
+    }
+    else if (line->ncommands == 1 && command->argc == 1 && line->redirect_input == NULL
+            && line->redirect_output == NULL && line->redirect_error == NULL
+            && (eq = strchr(command->argv[0], '=')) != NULL
+            && is_name(command->argv[0], eq - command->argv[0]))
+    {
+        // asignacion nombre=valor, su estado es el de la sustitucion si la tiene. la linea puede
+        // ser la de la cache, compartida con otros nodos, asi que el nombre se copia
+        name = strndup(command->argv[0], eq - command->argv[0]);
+        set_var(name, eq + 1);
+        free(name);
+        status = node->expand && subst_ran ? last_status : 0;
+    }
+    else if (line->ncommands == 1 && (b = find_builtin(command->argv[0])) != NULL)
+    {
+        status = run_builtin(line, b);
+    }
+    else if (strcmp(command->argv[0], "timeout") == 0)
+    {
+        status = execute_timeout(line);
+    }
+    else if (is_copy_line(line))
+    {
+        status = execute_copy(line);
+    }
+    else if (needs_batches(line, &parallel))
+    {
+        status = execute_batches(line, parallel);
+    }
+    else
+    {
+        // MSH_DEADLINE solo limita las tuberias en primer plano
+        status = execute_command(line, line->background ? NULL : default_timeout());
+    }
+
+    if (node->expand)
+    {
+        free_expanded_line(line);
+    }
+
+    return status;
+}
+
+/* funcion que evalua una expresion aritmetica como comando: 0 si su valor no es cero, 1 si lo es */
+int execute_arith(const char *expr)
+{
+    char *value;
+    int64_t result = 0;
+    int status;
+
+    expand_failed = 0;
+    value = expand_word(expr, NULL);
+    status = expand_failed || arith_eval(value, &result) != 0 || result == 0;
+    expand_failed = 0;
+    free(value);
+
+    return status;
+}
+
+/* funcion que evalua la condicion de un if, while, && o || sin avisar de los fallos */
+int execute_condition(tnode *node)
+{
+    int status;
+
+    in_condition++;
+    status = execute_list(node);
+    in_condition--;
+
+    return status;
+}
+
+/* funcion que ejecuta un nodo del arbol de control */
+int execute_node(tnode *node)
+{
+    int status = 0;
+    int saved[3];
+    int i;
+    tvec fields = {NULL, 0, 0};
+    char *targets[3];
+
+    // los bloques de control pueden tener sus propias redirecciones, que se expanden en cada ejecucion
+    if (node->redirect_input != NULL || node->redirect_output != NULL || node->redirect_error != NULL)
+    {
+        targets[0] = node->redirect_input != NULL ? expand_control_word(node->redirect_input, NULL) : NULL;
+        targets[1] = node->redirect_output != NULL ? expand_control_word(node->redirect_output, NULL) : NULL;
+        targets[2] = node->redirect_error != NULL ? expand_control_word(node->redirect_error, NULL) : NULL;
+        status = redirect_in_shell(targets[0], targets[1], targets[2], saved);
+        for (i = 0; i < 3; i++)
+        {
+            free(targets[i]);
+        }
+        if (status != 0)
+        {
+            last_status = 1;
+            return 1;
+        }
+    }
+    else
+    {
+        saved[0] = saved[1] = saved[2] = -1;
+    }
+
+    switch (node->type)
+    {
+        case NODE_SIMPLE:
+            status = execute_simple(node);
+            break;
+
+        case NODE_AND:
+        case NODE_OR:
+            status = execute_condition(node->cond);
+            if ((status == 0) == (node->type == NODE_AND))
+            {
+                status = execute_list(node->body);
+            }
+            break;
+
+        case NODE_IF:
+            if (execute_condition(node->cond) == 0)
+            {
+                status = execute_list(node->body);
+            }
+            else if (node->other != NULL)
+            {
+                status = execute_list(node->other);
+            }
+            break;
+
+        case NODE_WHILE:
+        case NODE_UNTIL:
+            while (run && !subst_exit && (execute_condition(node->cond) == 0) == (node->type == NODE_WHILE))
+            {
+                status = execute_list(node->body);
+            }
+            break;
+
+        case NODE_FOR:
+            expand_failed = 0;
+            for (i = 0; i < node->words.len; i++)
+            {
+                expand_fields(node->words.items[i], &fields);
+            }
+            status = expand_failed;
+            for (i = 0; i < fields.len && run && !subst_exit && !expand_failed; i++)
+            {
+                set_var(node->var, fields.items[i]);
+                status = execute_list(node->body);
+            }
+            expand_failed = 0;
+            vec_free(&fields);
+            break;
+
+        case NODE_ARITH:
+            status = execute_arith(node->expr);
+            break;
+    }
+
+    restore_in_shell(saved);
+    last_status = status;
+
+    return status;
+}
+
+/* funcion que ejecuta una lista de comandos y devuelve el estado del ultimo */
+int execute_list(tnode *node)
+{
+    int status = 0;
+
+    for (; node != NULL && run && !subst_exit; node = node->next)
+    {
+        status = execute_node(node);
+    }
+
+    return status;
+}
+
+/* funcion que crea un nodo vacio */
+tnode *node_new(tnode_type type)
+{
+    tnode *node = (tnode *) calloc(1, sizeof(tnode));
+
+    node->type = type;
+
+    return node;
+}
+
+/* funcion que libera una lista de nodos y todo lo que cuelga de ellos */
+void free_node(tnode *node)
+{
+    tnode *next;
+
+    while (node != NULL)
+    {
+        next = node->next;
+
+        if (node->cached != NULL)
+        {
+            cache_release(node->cached);
+        }
+        else
+        {
+            free(node->line);
+        }
+        free_node(node->cond);
+        free_node(node->body);
+        free_node(node->other);
+        free(node->var);
+        vec_free(&node->words);
+        vec_free(&node->subst);
+        free(node->expr);
+        free(node->redirect_input);
+        free(node->redirect_output);
+        free(node->redirect_error);
+        free(node);
+
+        node = next;
+    }
+}
+
+/* funcion que indica si el caracter termina una palabra */
+int is_delimiter(char c)
+{
+    return c == '\0' || c == ' ' || c == '\t' || c == '\n' || c == ';'
+        || c == '&' || c == '|' || c == '<' || c == '>';
+}
+
+/* funcion que marca el fallo del analisis: incompleto si se acabo el texto, error si no */
+void parser_fail(tparser *p)
+{
+    if (p->status == PARSE_OK)
+    {
+        p->status = p->s[p->pos] == '\0' ? PARSE_INCOMPLETE : PARSE_ERROR;
+    }
+}
+
+/* funcion que salta blancos y comentarios sin pasar de la linea */
+void parser_skip_blanks(tparser *p)
+{
+    while (p->s[p->pos] == ' ' || p->s[p->pos] == '\t')
+    {
+        p->pos++;
+    }
+    if (p->s[p->pos] == '#')
+    {
+        while (p->s[p->pos] != '\0' && p->s[p->pos] != '\n')
+        {
+            p->pos++;
+        }
+    }
+}
+
+/* funcion que salta blancos, comentarios, ';' y saltos de linea */
+void parser_skip_separators(tparser *p)
+{
+    while (1)
+    {
+        parser_skip_blanks(p);
+        if (p->s[p->pos] != ';' && p->s[p->pos] != '\n')
+        {
+            break;
+        }
+        p->pos++;
+    }
+}
+
+/* funcion que comprueba si en la posicion actual empieza la palabra reservada kw */
+int parser_keyword(tparser *p, const char *kw)
+{
+    size_t n = strlen(kw);
+
+    parser_skip_blanks(p);
+
+    return strncmp(p->s + p->pos, kw, n) == 0 && is_delimiter(p->s[p->pos + n]);
+}
+
+/* funcion que comprueba si viene una palabra reservada que cierra una lista */
+int parser_terminator(tparser *p)
+{
+    return parser_keyword(p, "then") || parser_keyword(p, "elif") || parser_keyword(p, "else")
+        || parser_keyword(p, "fi") || parser_keyword(p, "do") || parser_keyword(p, "done");
+}
+
+/* funcion que consume la palabra reservada kw o marca el fallo */
+int parser_expect(tparser *p, const char *kw)
+{
+    parser_skip_separators(p);
+
+    if (p->status == PARSE_OK && parser_keyword(p, kw))
+    {
+        p->pos += strlen(kw);
+        return 1;
+    }
+
+    parser_fail(p);
+    return 0;
+}
+
+/* funcion que lee una palabra, devuelve NULL si no hay palabra. sus comillas se dejan para la
+   expansion, como en los comandos simples, pero sus blancos y operadores no la terminan */
+char *parser_word(tparser *p)
+{
+    tbuffer b = {NULL, 0, 0};
+    char *quote_subst;
+    size_t n;
+
+    parser_skip_blanks(p);
+
+    while (!is_delimiter(p->s[p->pos]))
+    {
+        if (p->s[p->pos] == '$' && p->s[p->pos + 1] == '(')
+        {
+            // las expansiones $( ) se copian enteras aunque tengan blancos dentro
+            n = paren_length(p->s + p->pos + 1);
+            if (n == 0)
+            {
+                p->status = PARSE_INCOMPLETE;
+                free(b.data);
+                return NULL;
+            }
+            buffer_append(&b, p->s + p->pos, n + 1);
+            p->pos += n + 1;
+        }
+        else if (p->s[p->pos] == '`')
+        {
+            n = backquote_length(p->s + p->pos);
+            if (n == 0)
+            {
+                p->status = PARSE_INCOMPLETE;
+                free(b.data);
+                return NULL;
+            }
+            quote_subst = backquote_to_subst(p->s + p->pos, n);
+            buffer_append(&b, quote_subst, n + 1);
+            free(quote_subst);
+            p->pos += n;
+        }
+        else if (p->s[p->pos] == '\'' || p->s[p->pos] == '"')
+        {
+            n = quote_length(p->s + p->pos);
+            if (n == 0)
+            {
+                p->status = PARSE_INCOMPLETE;
+                free(b.data);
+                return NULL;
+            }
+            buffer_append(&b, p->s + p->pos, n);
+            p->pos += n;
+        }
+        else
+        {
+            buffer_append(&b, p->s + p->pos++, 1);
+        }
+    }
+
+    return b.data;
+}
+
+tnode *parse_list(tparser *p);
+tnode *parse_command(tparser *p);
+
+/* funcion que copia n caracteres del comando al texto para tokenize(), cambiando cada $( ) o ``
+   por una marca $\001indice\001, y cada texto entre comillas por una marca $\002indice\002, y
+   guardando el original en subst, ya que sus blancos y operadores no deben llegar a tokenize() */
+void extract_substs(const char *s, size_t n, tbuffer *text, tvec *subst)
+{
+    const char *end = s + n;
+    const char *start = s;
+    char mark[32];
+    size_t len;
+
+    for (; s < end; s++)
+    {
+        if ((*s == '\'' || *s == '"') && (len = quote_length(s)) > 0)
+        {
+            // se guarda con sus comillas, que se quitan al expandirlo sin partir su valor en palabras
+            buffer_append(text, start, s - start);
+            snprintf(mark, sizeof(mark), "$%c%d%c", SUBST_QUOTED, subst->len, SUBST_QUOTED);
+            buffer_append(text, mark, strlen(mark));
+            vec_push(subst, strndup(s, len));
+            s += len - 1;
+            start = s + 1;
+        }
+        else if ((s[0] == '$' && s[1] == '(' && (len = paren_length(s + 1) + 1) > 1)
+                    || (s[0] == '`' && (len = backquote_length(s)) > 0))
+        {
+            buffer_append(text, start, s - start);
+            snprintf(mark, sizeof(mark), "$%c%d%c", SUBST_MARK, subst->len, SUBST_MARK);
+            buffer_append(text, mark, strlen(mark));
+
+            // `comandos` se guarda como $(comandos)
+            vec_push(subst, s[0] == '`' ? backquote_to_subst(s, len) : strndup(s, len));
+            s += len - 1;
+            start = s + 1;
+        }
+    }
+
+    buffer_append(text, start, end - start);
+}
+
+/* funcion que analiza un comando simple: el texto hasta el siguiente ';', '\n', '&&', '||' o '&' */
+tnode *parse_simple(tparser *p)
+{
+    size_t start = p->pos;
+    size_t end;
+    size_t n;
+    char quote = 0;
+    char c;
+    tvec subst = {NULL, 0, 0};
+    tbuffer text = {NULL, 0, 0};
+    tline *line = NULL;
+    tcached *cached;
+    uint64_t hash;
+    tnode *node;
+
+    while ((c = p->s[p->pos]) != '\0')
+    {
+        if (c == '$' && p->s[p->pos + 1] == '(' && quote != '\'')
+        {
+            // dentro de $( ) los separadores no terminan el comando
+            n = paren_length(p->s + p->pos + 1);
+            if (n == 0)
+            {
+                p->status = PARSE_INCOMPLETE;
+                return NULL;
+            }
+            p->pos += n + 1;
+            continue;
+        }
+        else if (c == '`' && quote != '\'')
+        {
+            n = backquote_length(p->s + p->pos);
+            if (n == 0)
+            {
+                p->status = PARSE_INCOMPLETE;
+                return NULL;
+            }
+            p->pos += n;
+            continue;
+        }
+        else if (quote != 0)
+        {
+            if (c == quote)
+            {
+                quote = 0;
+            }
+        }
+        else if (c == '\'' || c == '"')
+        {
+            quote = c;
+        }
+        else if (c == ';' || c == '\n')
+        {
+            break;
+        }
+        else if (c == '#' && (p->s[p->pos - 1] == ' ' || p->s[p->pos - 1] == '\t'))
+        {
+            break;
+        }
+        else if ((c == '&' || c == '|') && p->s[p->pos + 1] == c)
+        {
+            break;
+        }
+        else if (c == '&' && p->s[p->pos - 1] != '>')
+        {
+            // el '&' de background forma parte del comando y lo termina
+            p->pos++;
+            break;
+        }
+        p->pos++;
+    }
+
+    if (quote != 0)
+    {
+        p->status = PARSE_INCOMPLETE;
+        return NULL;
+    }
+
+    end = p->pos;
+    parser_skip_blanks(p);
+    if (p->check)
+    {
+        return node_new(NODE_SIMPLE);
+    }
+
+    // tokenizamos una sola vez y guardamos una copia propia del resultado
+    extract_substs(p->s + start, end - start, &text, &subst);
+    buffer_append(&text, "\n", 1);
+    // las lineas repetidas (bucles del script, sustituciones, lineas generadas) salen de la cache
+    hash = hash_text(text.data, text.len);
+    cached = cache_lookup(text.data, text.len, hash);
+    if (cached == NULL)
+    {
+        trace_event(TRACE_TOKENIZE_BEGIN, 0, -1, text.len, text.data);
+        line = tokenize(text.data);
+        trace_event(TRACE_TOKENIZE_END, 0, -1, line != NULL ? line->ncommands : -1, text.data);
+        if (line == NULL || line->ncommands == 0)
+        {
+            free(text.data);
+            vec_free(&subst);
+            p->status = PARSE_ERROR;
+            return NULL;
+        }
+        cached = cache_insert(text.data, text.len, hash, line);
+    }
+
+    node = node_new(NODE_SIMPLE);
+    node->cached = cached;
+    node->line = cached != NULL ? cached->line : copy_tline(line);
+    node->expand = strchr(text.data, '$') != NULL;
+    node->subst = subst;
+    free(text.data);
+
+    return node;
+}
+
+/* funcion que analiza las redirecciones de un bloque de control: < fichero, > fichero y >& fichero */
+void parse_redirects(tparser *p, tnode *node)
+{
+    char **target;
+
+    while (p->status == PARSE_OK)
+    {
+        parser_skip_blanks(p);
+
+        if (p->s[p->pos] == '<')
+        {
+            p->pos++;
+            target = &node->redirect_input;
+        }
+        else if (p->s[p->pos] == '>' && p->s[p->pos + 1] == '&')
+        {
+            p->pos += 2;
+            target = &node->redirect_error;
+        }
+        else if (p->s[p->pos] == '>')
+        {
+            p->pos++;
+            target = &node->redirect_output;
+        }
+        else
+        {
+            break;
+        }
+
+        free(*target);
+        *target = parser_word(p);
+        if (*target == NULL)
+        {
+            parser_fail(p);
+        }
+    }
+}
+
+/* funcion que analiza if lista; then lista; [elif lista; then lista;]... [else lista;] fi */
+tnode *parse_if(tparser *p)
+{
+    tnode *node = node_new(NODE_IF);
+
+    p->pos += 2;
+
+    node->cond = parse_list(p);
+    if (node->cond == NULL)
+    {
+        parser_fail(p);
+    }
+    if (p->status != PARSE_OK || !parser_expect(p, "then"))
+    {
+        return node;
+    }
+
+    node->body = parse_list(p);
+    if (node->body == NULL)
+    {
+        parser_fail(p);
+    }
+    if (p->status != PARSE_OK)
+    {
+        return node;
+    }
+
+    parser_skip_separators(p);
+    if (parser_keyword(p, "elif"))
+    {
+        // un elif es un if anidado en la rama else que consume el fi
+        p->pos += 2;
+        node->other = parse_if(p);
+        return node;
+    }
+    if (parser_keyword(p, "else"))
+    {
+        p->pos += 4;
+        node->other = parse_list(p);
+        if (node->other == NULL)
+        {
+            parser_fail(p);
+        }
+    }
+    if (p->status == PARSE_OK)
+    {
+        parser_expect(p, "fi");
+    }
+
+    return node;
+}
+
+/* funcion que analiza el "do lista; done" de los bucles */
+void parse_loop_body(tparser *p, tnode *node)
+{
+    if (p->status != PARSE_OK || !parser_expect(p, "do"))
+    {
+        return;
+    }
+
+    node->body = parse_list(p);
+    if (node->body == NULL)
+    {
+        parser_fail(p);
+    }
+    if (p->status == PARSE_OK)
+    {
+        parser_expect(p, "done");
+    }
+}
+
+/* funcion que analiza while/until lista; do lista; done */
+tnode *parse_while(tparser *p, tnode_type type)
+{
+    tnode *node = node_new(type);
+
+    p->pos += 5; // "while" y "until" tienen la misma longitud
+
+    node->cond = parse_list(p);
+    if (node->cond == NULL)
+    {
+        parser_fail(p);
+    }
+    parse_loop_body(p, node);
+
+    return node;
+}
+
+/* funcion que analiza for nombre [in palabras]; do lista; done */
+tnode *parse_for(tparser *p)
+{
+    tnode *node = node_new(NODE_FOR);
+    char *word;
+
+    p->pos += 3;
+
+    node->var = parser_word(p);
+    if (node->var == NULL || !is_name(node->var, strlen(node->var)))
+    {
+        parser_fail(p);
+        return node;
+    }
+
+    if (parser_keyword(p, "in"))
+    {
+        p->pos += 2;
+        while (p->status == PARSE_OK)
+        {
+            parser_skip_blanks(p);
+            if (p->s[p->pos] == ';' || p->s[p->pos] == '\n')
+            {
+                p->pos++;
+                break;
+            }
+            if (p->s[p->pos] == '\0')
+            {
+                break;
+            }
+
+            word = parser_word(p);
+            if (word == NULL)
+            {
+                parser_fail(p);
+                break;
+            }
+            vec_push(&node->words, word);
+        }
+    }
+    parse_loop_body(p, node);
+
+    return node;
+}
+
+/* funcion que analiza el comando aritmetico (( expresion )) */
+tnode *parse_arith(tparser *p)
+{
+    tnode *node = node_new(NODE_ARITH);
+    size_t n = paren_length(p->s + p->pos);
+
+    if (n == 0 || p->s[p->pos + n - 2] != ')')
+    {
+        // sin cerrar falta texto; cerrado con un solo ')' es un error
+        p->status = n == 0 ? PARSE_INCOMPLETE : PARSE_ERROR;
+        return node;
+    }
+
+    node->expr = strndup(p->s + p->pos + 2, n - 4);
+    p->pos += n;
+
+    return node;
+}
+
+/* funcion que analiza un comando: un bloque de control con sus redirecciones o un comando simple */
+tnode *parse_command(tparser *p)
+{
+    tnode *node;
+    char c;
+
+    parser_skip_blanks(p);
+    c = p->s[p->pos];
+
+    if (parser_keyword(p, "if"))
+    {
+        node = parse_if(p);
+    }
+    else if (parser_keyword(p, "while"))
+    {
+        node = parse_while(p, NODE_WHILE);
+    }
+    else if (parser_keyword(p, "until"))
+    {
+        node = parse_while(p, NODE_UNTIL);
+    }
+    else if (parser_keyword(p, "for"))
+    {
+        node = parse_for(p);
+    }
+    else if (c == '(' && p->s[p->pos + 1] == '(')
+    {
+        node = parse_arith(p);
+    }
+    else if (c == '\0' || c == ';' || c == '\n' || c == '&' || c == '|' || parser_terminator(p))
+    {
+        parser_fail(p);
+        return NULL;
+    }
+    else
+    {
+        return parse_simple(p);
+    }
+
+    parse_redirects(p, node);
+
+    return node;
+}
+
+/* funcion que analiza comandos unidos con && y || */
+tnode *parse_and_or(tparser *p)
+{
+    tnode *left = parse_command(p);
+    tnode *node;
+
+    while (left != NULL && p->status == PARSE_OK)
+    {
+        parser_skip_blanks(p);
+
+        if (strncmp(p->s + p->pos, "&&", 2) == 0)
+        {
+            node = node_new(NODE_AND);
+        }
+        else if (strncmp(p->s + p->pos, "||", 2) == 0)
+        {
+            node = node_new(NODE_OR);
+        }
+        else
+        {
+            break;
+        }
+        p->pos += 2;
+
+        // tras && o || se puede continuar en la linea siguiente
+        while (parser_skip_blanks(p), p->s[p->pos] == '\n')
+        {
+            p->pos++;
+        }
+
+        node->cond = left;
+        node->body = parse_command(p);
+        left = node;
+    }
+
+    return left;
+}
+
+/* funcion que salta los separadores e indica si la lista se ha acabado: fin del texto o palabra reservada */
+int parser_list_end(tparser *p)
+{
+    parser_skip_separators(p);
+
+    return p->s[p->pos] == '\0' || parser_terminator(p);
+}
+
+/* funcion que analiza un comando de una lista con su separador */
+tnode *parse_item(tparser *p)
+{
+    tnode *node = parse_and_or(p);
+    size_t i;
+    char c;
+
+    if (p->status != PARSE_OK)
+    {
+        return node;
+    }
+
+    // tras un comando tiene que venir un separador, el final o una palabra reservada,
+    // salvo que el comando fuera a background
+    for (i = p->pos; i > 0 && (p->s[i - 1] == ' ' || p->s[i - 1] == '\t'); i--)
+    {
+    }
+    if (i > 0 && p->s[i - 1] == '&')
+    {
+        return node;
+    }
+    parser_skip_blanks(p);
+    c = p->s[p->pos];
+    if (c != ';' && c != '\n' && c != '\0' && !parser_terminator(p))
+    {
+        parser_fail(p);
+    }
+
+    return node;
+}
+
+/* funcion que analiza una lista de comandos separados por ';' o '\n' hasta una palabra reservada */
+tnode *parse_list(tparser *p)
+{
+    tnode *head = NULL;
+    tnode **tail = &head;
+    tnode *node;
+
+    while (p->status == PARSE_OK && !parser_list_end(p))
+    {
+        node = parse_item(p);
+        if (node != NULL)
+        {
+            *tail = node;
+            tail = &node->next;
+        }
+    }
+
+    return head;
+}
+
+/* funcion que analiza un texto completo; status indica si falta texto o hay un error */
+tnode *parse_text(const char *s, int *status)
+{
+    tparser p = {s, 0, PARSE_OK, 0};
+    tnode *list = parse_list(&p);
+
+    // una palabra reservada suelta (fi, done...) al nivel principal es un error
+    if (p.status == PARSE_OK && p.s[p.pos] != '\0')
+    {
+        p.status = PARSE_ERROR;
+    }
+
+    *status = p.status;
+
+    return list;
+}
+
+/* funcion que indica si un texto esta completo, incompleto o es erroneo sin tokenizar sus
+   comandos ni consultar la cache, para las lineas de continuacion */
+int parse_check(const char *s)
+{
+    tparser p = {s, 0, PARSE_OK, 1};
+
+    free_node(parse_list(&p));
+
+    return p.status == PARSE_OK && p.s[p.pos] != '\0' ? PARSE_ERROR : p.status;
+}
+
+/* funcion que inserta n caracteres en la posicion pos del buffer */
+void buffer_insert(tbuffer *b, size_t pos, const char *s, size_t n)
+{
+    size_t tail = b->len - pos;
+
+    buffer_append(b, s, n);
+    memmove(b->data + pos + n, b->data + pos, tail);
+    memcpy(b->data + pos, s, n);
+}
+
+/* funcion que borra n caracteres desde la posicion pos del buffer */
+void buffer_erase(tbuffer *b, size_t pos, size_t n)
+{
+    memmove(b->data + pos, b->data + pos + n, b->len - pos - n + 1);
+    b->len -= n;
+}
+
+/* funcion que inserta un nombre en el trie manteniendo los hermanos ordenados */
+void trie_insert(ttrie **root, const char *name)
+{
+    ttrie **level = root;
+    ttrie *node = NULL;
+
+    for (; *name != '\0'; name++)
+    {
+        while (*level != NULL && (unsigned char) (*level)->c < (unsigned char) *name)
+        {
+            level = &(*level)->next;
+        }
+        if (*level == NULL || (*level)->c != *name)
+        {
+            node = (ttrie *) calloc(1, sizeof(ttrie));
+            node->c = *name;
+            node->next = *level;
+            *level = node;
+        }
+        node = *level;
+        level = &node->child;
+    }
+
+    if (node != NULL)
+    {
+        node->end = 1;
+    }
+}
+
+/* funcion que libera un nivel del trie con todos sus descendientes */
+void trie_free(ttrie *node)
+{
+    ttrie *next;
+
+    for (; node != NULL; node = next)
+    {
+        next = node->next;
+        trie_free(node->child);
+        free(node);
+    }
+}
+
+/* funcion que añade a out todos los nombres que cuelgan de un nivel del trie */
+void trie_collect(ttrie *level, tbuffer *name, tvec *out)
+{
+    for (; level != NULL; level = level->next)
+    {
+        buffer_append(name, &level->c, 1);
+        if (level->end)
+        {
+            vec_push(out, strdup(name->data));
+        }
+        trie_collect(level->child, name, out);
+        name->data[--name->len] = '\0';
+    }
+}
+
+/* funcion que añade a out los nombres del trie que empiezan por prefix */
+void trie_complete(ttrie *root, const char *prefix, tvec *out)
+{
+    tbuffer name = {NULL, 0, 0};
+    ttrie *level = root;
+    ttrie *node = NULL;
+    const char *p;
+
+    for (p = prefix; *p != '\0'; p++)
+    {
+        while (level != NULL && level->c != *p)
+        {
+            level = level->next;
+        }
+        if (level == NULL)
+        {
+            return;
+        }
+        node = level;
+        level = node->child;
+    }
+
+    buffer_append(&name, prefix, strlen(prefix));
+    if (node != NULL && node->end)
+    {
+        vec_push(out, strdup(prefix));
+    }
+    trie_collect(level, &name, out);
+    free(name.data);
+}
+
+/* funcion que indexa en el trie los ejecutables de un directorio */
+void index_directory(const char *dir)
+{
+    struct dirent *entry;
+    struct stat st;
+    DIR *d = opendir(dir);
+
+    if (d == NULL)
+    {
+        return;
+    }
+
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (entry->d_name[0] == '.' || entry->d_type == DT_DIR
+                || faccessat(dirfd(d), entry->d_name, X_OK, 0) != 0)
+        {
+            continue;
+        }
+
+        // los enlaces y los tipos desconocidos se comprueban con stat
+        if (entry->d_type != DT_REG && (fstatat(dirfd(d), entry->d_name, &st, 0) != 0 || !S_ISREG(st.st_mode)))
+        {
+            continue;
+        }
+
+        trie_insert(&commands_trie, entry->d_name);
+    }
+
+    closedir(d);
+}
+
+/* funcion que reconstruye el trie de ejecutables solo si ha cambiado el PATH o la fecha
+   de modificacion de alguno de sus directorios (se crea o borra un ejecutable) */
+void refresh_commands_trie()
+{
+    const char *path = getenv("PATH") != NULL ? getenv("PATH") : "";
+    const char *p;
+    const char *colon;
+    struct stat st;
+    int stale;
+    int i;
+
+    stale = indexed_path == NULL || strcmp(path, indexed_path) != 0;
+    for (i = 0; i < npath_dirs && !stale; i++)
+    {
+        if (stat(path_dirs[i].dir, &st) != 0)
+        {
+            st.st_mtim.tv_sec = 0;
+            st.st_mtim.tv_nsec = 0;
+        }
+        stale = st.st_mtim.tv_sec != path_dirs[i].mtime.tv_sec || st.st_mtim.tv_nsec != path_dirs[i].mtime.tv_nsec;
+    }
+    if (!stale)
+    {
+        return;
+    }
+
+    trie_free(commands_trie);
+    commands_trie = NULL;
+    for (i = 0; i < npath_dirs; i++)
+    {
+        free(path_dirs[i].dir);
+    }
+    free(path_dirs);
+    free(indexed_path);
+    indexed_path = strdup(path);
+    path_dirs = NULL;
+    npath_dirs = 0;
+
+    for (p = path; ; p = colon + 1)
+    {
+        colon = strchr(p, ':');
+        if (colon == NULL)
+        {
+            colon = p + strlen(p);
+        }
+
+        // un directorio vacio en el PATH es el directorio actual
+        path_dirs = realloc(path_dirs, (npath_dirs + 1) * sizeof(tpath_dir));
+        path_dirs[npath_dirs].dir = colon > p ? strndup(p, colon - p) : strdup(".");
+        if (stat(path_dirs[npath_dirs].dir, &st) != 0)
+        {
+            st.st_mtim.tv_sec = 0;
+            st.st_mtim.tv_nsec = 0;
+        }
+        path_dirs[npath_dirs].mtime = st.st_mtim;
+        index_directory(path_dirs[npath_dirs].dir);
+        npath_dirs++;
+
+        if (*colon == '\0')
+        {
+            break;
+        }
+    }
+}
+
+/* funcion que añade a out los ficheros que empiezan por prefix, con '/' detras de los directorios */
+void complete_files(const char *prefix, tvec *out)
+{
+    const char *slash = strrchr(prefix, '/');
+    const char *base = slash != NULL ? slash + 1 : prefix;
+    size_t dir_len = base - prefix;
+    size_t base_len = strlen(base);
+    char *dir = slash != NULL ? strndup(prefix, dir_len) : strdup(".");
+    struct dirent *entry;
+    struct stat st;
+    tbuffer name = {NULL, 0, 0};
+    DIR *d = opendir(dir);
+
+    if (d != NULL)
+    {
+        while ((entry = readdir(d)) != NULL)
+        {
+            // los ocultos solo si se han empezado a escribir
+            if (strncmp(entry->d_name, base, base_len) != 0 || strcmp(entry->d_name, ".") == 0
+                    || strcmp(entry->d_name, "..") == 0 || (entry->d_name[0] == '.' && base[0] != '.'))
+            {
+                continue;
+            }
+
+            name.len = 0;
+            buffer_append(&name, prefix, dir_len);
+            buffer_append(&name, entry->d_name, strlen(entry->d_name));
+            if (fstatat(dirfd(d), entry->d_name, &st, 0) == 0 && S_ISDIR(st.st_mode))
+            {
+                buffer_append(&name, "/", 1);
+            }
+            vec_push(out, strdup(name.data));
+        }
+        closedir(d);
+    }
+
+    free(name.data);
+    free(dir);
+}
+
+/* funcion de comparacion de cadenas para qsort */
+int compare_strings(const void *a, const void *b)
+{
+    return strcmp(*(char * const *) a, *(char * const *) b);
+}
+
+/* funcion que completa la palabra que hay antes del cursor: comandos (builtins y ejecutables
+   del PATH) si es la primera palabra de un comando, ficheros en otro caso. con un solo
+   candidato lo completa entero, con varios el prefijo comun y al segundo tabulador los lista */
+void complete_word(tbuffer *line, size_t *cursor, int tabs, const char *prompt)
+{
+    tvec candidates = {NULL, 0, 0};
+    const tbuiltin *b;
+    char *prefix;
+    size_t start = *cursor;
+    size_t k;
+    size_t common;
+    size_t prefix_len;
+    int command;
+    int i;
+    int j;
+
+    while (start > 0 && strchr(" \t|;&<>", line->data[start - 1]) == NULL)
+    {
+        start--;
+    }
+    k = start;
+    while (k > 0 && (line->data[k - 1] == ' ' || line->data[k - 1] == '\t'))
+    {
+        k--;
+    }
+    command = k == 0 || strchr("|;&", line->data[k - 1]) != NULL;
+
+    prefix = strndup(line->data + start, *cursor - start);
+    prefix_len = strlen(prefix);
+
+    if (command && strchr(prefix, '/') == NULL)
+    {
+        refresh_commands_trie();
+        trie_complete(commands_trie, prefix, &candidates);
+        for (b = builtins; b->name != NULL; b++)
+        {
+            if (strncmp(b->name, prefix, prefix_len) == 0)
+            {
+                vec_push(&candidates, strdup(b->name));
+            }
+        }
+    }
+    else
+    {
+        complete_files(prefix, &candidates);
+    }
+
+    // ordenamos y quitamos repetidos (un builtin tambien puede estar en el PATH)
+    qsort(candidates.items, candidates.len, sizeof(char *), compare_strings);
+    for (i = 0, j = 0; i < candidates.len; i++)
+    {
+        if (j > 0 && strcmp(candidates.items[j - 1], candidates.items[i]) == 0)
+        {
+            free(candidates.items[i]);
+        }
+        else
+        {
+            candidates.items[j++] = candidates.items[i];
+        }
+    }
+    candidates.len = j;
+
+    if (candidates.len > 0)
+    {
+        // prefijo comun de todos los candidatos
+        common = strlen(candidates.items[0]);
+        for (i = 1; i < candidates.len; i++)
+        {
+            for (k = 0; k < common && candidates.items[i][k] == candidates.items[0][k]; k++)
+            {
+            }
+            common = k;
+        }
+
+        if (common > prefix_len)
+        {
+            buffer_insert(line, *cursor, candidates.items[0] + prefix_len, common - prefix_len);
+            *cursor += common - prefix_len;
+        }
+        if (candidates.len == 1 && candidates.items[0][common - 1] != '/')
+        {
+            buffer_insert(line, *cursor, " ", 1);
+            (*cursor)++;
+        }
+        else if (candidates.len > 1 && common == prefix_len && tabs > 1)
+        {
+            printf("\r\n");
+            if (candidates.len > 200)
+            {
+                printf("Hay %d posibilidades\r\n", candidates.len);
+            }
+            else
+            {
+                for (i = 0; i < candidates.len; i++)
+                {
+                    printf("%s%s", candidates.items[i], i < candidates.len - 1 ? "  " : "\r\n");
+                }
+            }
+            printf("%s", prompt);
+            fflush(stdout);
+        }
+    }
+
+    vec_free(&candidates);
+    free(prefix);
+}
+
+/* funcion que vuelve a pintar el prompt y la linea dejando el cursor en su sitio */
+void redraw_line(const char *prompt, tbuffer *line, size_t cursor)
+{
+    tbuffer out = {NULL, 0, 0};
+    char move[32];
+
+    buffer_append(&out, "\r", 1);
+    buffer_append(&out, prompt, strlen(prompt));
+    buffer_append(&out, line->data, line->len);
+    buffer_append(&out, "\x1b[K", 3);
+    if (cursor < line->len)
+    {
+        snprintf(move, sizeof(move), "\x1b[%zuD", line->len - cursor);
+        buffer_append(&out, move, strlen(move));
+    }
+
+    write(1, out.data, out.len);
+    free(out.data);
+}
+
+/* funcion que lee una linea del terminal en modo raw, con edicion basica (flechas, inicio, fin,
+   borrar) y completado con el tabulador; devuelve NULL al final de la entrada o con Ctrl-C */
+char *edit_line(const char *prompt, size_t *n)
+{
+    static tbuffer line = {NULL, 0, 0};
+    struct termios old;
+    struct termios raw;
+    size_t cursor = 0;
+    char *result = NULL;
+    char seq[3];
+    char c;
+    int tabs = 0;
+
+    line.len = 0;
+    buffer_append(&line, "", 0);
+
+    tcgetattr(0, &old);
+    raw = old;
+    raw.c_iflag &= ~(ICRNL | IXON);
+    raw.c_lflag &= ~(ICANON | ECHO | ISIG | IEXTEN);
+    raw.c_cc[VMIN] = 1;
+    raw.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSADRAIN, &raw);
+    fflush(stdout);
+
+    while (read(0, &c, 1) == 1)
+    {
+        tabs = c == '\t' ? tabs + 1 : 0;
+
+        if (c == '\r' || c == '\n')
+        {
+            write(1, "\r\n", 2);
+            result = line.data;
+            break;
+        }
+        else if (c == 3 || c == 28)
+        {
+            // en modo raw Ctrl-C y Ctrl-\ no generan la señal, hacemos lo mismo que su manejador
+            write(1, "\r\n", 2);
+            exit_handler(c == 3 ? SIGINT : SIGQUIT);
+            break;
+        }
+        else if (c == 4 && line.len == 0)
+        {
+            // Ctrl-D con la linea vacia es el final de la entrada
+            write(1, "\r\n", 2);
+            break;
+        }
+        else if ((c == 4 || c == 127 || c == 8) && line.len > 0)
+        {
+            // Ctrl-D borra el caracter del cursor y retroceso el anterior
+            if (c != 4 && cursor > 0)
+            {
+                buffer_erase(&line, --cursor, 1);
+            }
+            else if (c == 4 && cursor < line.len)
+            {
+                buffer_erase(&line, cursor, 1);
+            }
+        }
+        else if (c == '\t')
+        {
+            complete_word(&line, &cursor, tabs, prompt);
+        }
+        else if (c == 1)
+        {
+            cursor = 0;
+        }
+        else if (c == 5)
+        {
+            cursor = line.len;
+        }
+        else if (c == 2 && cursor > 0)
+        {
+            cursor--;
+        }
+        else if (c == 6 && cursor < line.len)
+        {
+            cursor++;
+        }
+        else if (c == 21)
+        {
+            buffer_erase(&line, 0, cursor);
+            cursor = 0;
+        }
+        else if (c == 11)
+        {
+            buffer_erase(&line, cursor, line.len - cursor);
+        }
+        else if (c == 27)
+        {
+            // secuencias de escape de las flechas, inicio, fin y suprimir
+            if (read(0, seq, 1) != 1 || read(0, seq + 1, 1) != 1 || (seq[0] != '[' && seq[0] != 'O'))
+            {
+                continue;
+            }
+            if (seq[1] == 'D' && cursor > 0)
+            {
+                cursor--;
+            }
+            else if (seq[1] == 'C' && cursor < line.len)
+            {
+                cursor++;
+            }
+            else if (seq[1] == 'H')
+            {
+                cursor = 0;
+            }
+            else if (seq[1] == 'F')
+            {
+                cursor = line.len;
+            }
+            else if (seq[1] == '3' && read(0, seq + 2, 1) == 1 && seq[2] == '~' && cursor < line.len)
+            {
+                buffer_erase(&line, cursor, 1);
+            }
+        }
+        else if ((unsigned char) c >= 32)
+        {
+            buffer_insert(&line, cursor++, &c, 1);
+
+            // mientras se escribe el nombre del comando se va precargando el ejecutable
+            if (cursor >= 2 && cursor == line.len && strcspn(line.data, " \t") == cursor)
+            {
+                prefetch_prefix(line.data, cursor);
+            }
+        }
+
+        redraw_line(prompt, &line, cursor);
+    }
+
+    tcsetattr(0, TCSADRAIN, &old);
+    *n = line.len;
+
+    return result;
+}
+
+/* funcion que comprueba si quedan hijos sin terminar (comandos en background), recogiendo los que ya acabaron */
+int pending_jobs()
+{
+    int status;
+    pid_t pid;
+
+    while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+    {
+    }
+
+    return pid == 0;
+}
+
+/* funcion que comprueba si el ultimo comando de un script puede reemplazar al shell con execvp():
+   un solo comando externo en primer plano, sin tiempo limite ni trabajos en background.
+   se decide antes de expandir para no ejecutar dos veces sus sustituciones */
+int can_tail_exec(tnode *node)
+{
+    tcommand *command;
+
+    if (node->type != NODE_SIMPLE || node->line->ncommands != 1 || node->line->background)
+    {
+        return 0;
+    }
+
+    command = &node->line->commands[0];
+    if (strchr(command->argv[0], '$') != NULL || is_assignment(command->argv[0])
+            || find_builtin(command->argv[0]) != NULL || strcmp(command->argv[0], "timeout") == 0)
+    {
+        return 0;
+    }
+
+    // una copia pura con cat es mas rapida en el shell que reemplazandolo por cat
+    return default_timeout() == NULL && !is_copy_line(node->line) && !pending_jobs();
+}
+
+/* funcion que ejecuta el ultimo comando reemplazando al shell; solo vuelve si falla la expansion
+   o si el comando se tiene que ejecutar por tandas */
+int tail_exec(tnode *node)
+{
+    tline *line = node->line;
+    int parallel;
+    int status;
+    int error;
+
+    if (node->expand)
+    {
+        expand_failed = 0;
+        subst_ran = 0;
+        line = expand_line(node->line, &node->subst);
+        if (expand_failed || line->commands[0].argc == 0)
+        {
+            free_expanded_line(line);
+            return expand_failed ? 1 : subst_ran ? last_status : 0;
+        }
+    }
+
+    if (needs_batches(line, &parallel))
+    {
+        status = execute_batches(line, parallel);
+        if (node->expand)
+        {
+            free_expanded_line(line);
+        }
+        return status;
+    }
+
+    // las redirecciones se hacen en el propio shell, que ya no las necesita
+    redirect_to_stdin(line);
+    redirect_to_stdout(line);
+    redirect_to_stderr(line);
+
+    reader_sync(input);
+    fflush(stdout);
+    fflush(stderr);
+
+    execvp(line->commands[0].argv[0], line->commands[0].argv);
+    error = errno;
+    trace_event(TRACE_EXEC_FAIL, 0, 0, error, line->commands[0].argv[0]);
+    if (error == ENOENT)
+    {
+        fprintf(stderr, "El comando %s no se encuentra.", line->commands[0].argv[0]);
+    }
+    else
+    {
+        printf("Se ha producido un error en la ejecucion del comando.\n");
+    }
+    exit(1);
+}
+
+/* funcion que ejecuta un script o una cadena de -c entera; el ultimo comando reemplaza al
+   shell en vez de hacer fork() y esperarlo, asi un script envoltorio cuesta un proceso menos.
+   cada comando del nivel principal se analiza justo antes de ejecutarlo: ve los ficheros, el
+   directorio y las variables que han dejado los anteriores, y un error de sintaxis mas adelante
+   no impide ejecutar lo que va antes */
+int run_script(const char *text)
+{
+    tparser p = {text, 0, PARSE_OK, 0};
+    tnode *node;
+    int status = 0;
+
+    while (run && !parser_list_end(&p))
+    {
+        node = parse_item(&p);
+        if (p.status != PARSE_OK)
+        {
+            fprintf(stderr, "Error de sintaxis en el script.\n");
+            free_node(node);
+            return 2;
+        }
+        if (node == NULL)
+        {
+            continue;
+        }
+
+        // solo el comando tras el que no queda texto puede reemplazar al shell
+        if (parser_list_end(&p) && p.s[p.pos] == '\0' && can_tail_exec(node))
+        {
+            status = tail_exec(node);
+        }
+        else
+        {
+            status = execute_node(node);
+        }
+        free_node(node);
+    }
+
+    // una palabra reservada suelta (fi, done...) al nivel principal es un error
+    if (run && p.s[p.pos] != '\0')
+    {
+        fprintf(stderr, "Error de sintaxis en el script.\n");
+        return 2;
+    }
+
+    return status;
+}
+
+/* funcion que prepara las señales, la entrada y la traza del shell */
+void init_shell()
+{
+    // deshabilitamos las señales
+    signal(SIGINT, exit_handler);
+    signal(SIGQUIT, exit_handler);
+
+    input = reader_new(0);
+    trace_open();
+}
+
+/* funcion que lee un script entero */
+char *read_script(const char *file)
+{
+    tbuffer text = {NULL, 0, 0};
+    treader *r;
+    char *buf;
+    size_t n;
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+
+    if (fd == -1)
+    {
+        fprintf(stderr, "No ha sido posible abrir el archivo %s \n. Error: %s\n", file, strerror(errno));
+        return NULL;
+    }
+
+    r = reader_new(fd);
+    buffer_append(&text, "", 0);
+    while ((buf = reader_getline(r, &n)) != NULL)
+    {
+        buffer_append(&text, buf, n);
+        buffer_append(&text, "\n", 1);
+    }
+    reader_free(r);
+    close(fd);
+
+    return text.data;
+}
+
+/* funcion principal */
+int main(int argc, char *argv[])
+{
+    if (argc == 1)
     {
         // variables
-        char buf[SIZE];
-        tline *line;
+        tbuffer text = {NULL, 0, 0};
+        tnode *list;
+        char *buf;
+        const char *prompt = "msh> ";
+        size_t n;
+        int status;
+        int interactive = isatty(0);
 
-        // deshabilitamos las señales
-        signal(SIGINT, exit_handler);
-        signal(SIGQUIT, exit_handler);
+        init_shell();
 
         // pintamos el prompt por primera vez
         printf("msh> ");
+        fflush(stdout);
 
         // variable run para controlar el prompt después de cada instrucción
         while (run)
         {
-            // mientras que la línea no sea nula
-            if (fgets(buf, SIZE, stdin) != NULL)
+            // mientras se espera la linea se precargan los ejecutables mas usados
+            if (interactive)
             {
-                // tokenizamos la linea
-                line = tokenize(buf);
+                prefetch_hot();
+            }
 
-                // y la línea tokenizada tampoco sea nula
-                if (line != NULL)
-                {
-                    // ejecutamos comandos dependiendo del caso
-                    if (handle_command(line, 1, "exit") == 0 || handle_command(line, 1, "EXIT") == 0)
-                    {
-                        exit_handler();
-                        return 0;
-                    }
-                    else if (handle_command(line, 1, "cd") == 0)
-                    {
-                        execute_cd_command(line);
-                    }
-                    else
-                    {
-                        execute_command(line);
-                    }
-                }
+            // al final de la entrada terminamos; en un terminal se edita la linea en modo raw
+            buf = interactive ? edit_line(prompt, &n) : reader_getline(input, &n);
+            if (buf == NULL)
+            {
+                break;
+            }
+            trace_event(TRACE_LINE_READ, 0, -1, n, buf);
+
+            // acumulamos lineas hasta que el bloque de control este completo
+            buffer_append(&text, buf, n);
+            buffer_append(&text, "\n", 1);
+            // hasta que este completo no se tokeniza, asi cada linea pasa una sola vez por la cache
+            if (parse_check(text.data) == PARSE_INCOMPLETE)
+            {
+                prompt = "> ";
+                printf("%s", prompt);
+                fflush(stdout);
+                continue;
+            }
+
+            list = parse_text(text.data, &status);
+            if (status == PARSE_ERROR)
+            {
+                fprintf(stderr, "Error de sintaxis en la linea introducida.\n");
+            }
+            else
+            {
+                execute_list(list);
             }
+            free_node(list);
+            text.len = 0;
 
             // pintamos el prompt a la vuelta
-            printf("msh> ");
+            prompt = "msh> ";
+            printf("%s", prompt);
+            fflush(stdout);
+        }
+
+        free(text.data);
+    }
+    else if (argc == 3 && strcmp(argv[1], "-c") == 0)
+    {
+        init_shell();
+        return run_script(argv[2]);
+    }
+    else if (argc == 2 && argv[1][0] != '-')
+    {
+        // variables
+        char *text = read_script(argv[1]);
+        int status;
+
+        if (text == NULL)
+        {
+            return 127;
         }
+
+        init_shell();
+        status = run_script(text);
+        free(text);
+
+        return status;
     }
     else
     {
-        fprintf(stderr, "Error en el uso del programa, el uso correcto es sin comandos: %s \n", argv[0]);
+        fprintf(stderr, "Error en el uso del programa, el uso correcto es: %s [-c comandos | script] \n", argv[0]);
         return 1;
     }
 
@@ -0,0 +1,42 @@
+#include <stdint.h>
+
+/* formato del fichero de traza de msh (MSH_TRACE=fichero): una cabecera seguida de un
+   buffer circular de registros de tamaño fijo, compartido con mmap entre el shell y sus hijos */
+
+#define TRACE_MAGIC "MSHTRACE"
+#define TRACE_VERSION 1
+#define TRACE_RECORDS 65536
+#define TRACE_NAME 16
+
+typedef enum
+{
+    TRACE_LINE_READ = 1,  // linea leida, arg = longitud
+    TRACE_TOKENIZE_BEGIN, // arg = longitud del texto
+    TRACE_TOKENIZE_END,   // arg = numero de comandos, -1 si hay error
+    TRACE_FORK,           // pid = hijo, arg = numero de comandos de la tuberia
+    TRACE_EXEC_FAIL,      // pid = hijo, arg = errno
+    TRACE_REDIRECT,       // pid = hijo, arg = descriptor redirigido
+    TRACE_WAIT_DONE,      // pid = hijo, arg = estado de waitpid()
+    TRACE_SIGNAL          // arg = numero de la señal
+} ttrace_event;
+
+typedef struct
+{
+    uint64_t time;          // nanosegundos de CLOCK_MONOTONIC
+    int64_t arg;            // dato del evento
+    int32_t pid;            // proceso al que se refiere el evento
+    int32_t stage;          // indice del comando en la tuberia, -1 si no aplica
+    uint32_t event;
+    uint32_t reserved;
+    char name[TRACE_NAME];  // comando, fichero o texto, recortado y terminado en '\0'
+} ttrace_record;
+
+typedef struct
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t record_size;
+    uint64_t capacity;      // numero de registros del buffer circular
+    uint64_t head;          // registros escritos en total, el siguiente va en head % capacity
+    char reserved[32];
+} ttrace_header;